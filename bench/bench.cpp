@@ -0,0 +1,365 @@
+#include "primitives.h"
+#include "workload.h"
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+
+// The heap counter of BM_Footprint needs mallinfo2() from glibc 2.33
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define BENCH_HAS_MALLINFO2 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define BENCH_HAS_MKSTEMP 1
+#endif
+
+// Every benchmark takes the distribution and the number of points as its first two arguments.
+// The inputs are generated from fixed seeds, so runs on different machines measure the same work.
+// Cache misses are reported with --benchmark_perf_counters=CACHE-MISSES when Google Benchmark
+// is built with libpfm.
+
+namespace {
+
+constexpr std::uint64_t points_seed = 1;
+constexpr std::uint64_t queries_seed = 2;
+constexpr std::size_t query_count = 1 << 12;
+
+// kd-tree keeping up to 16 points in a leaf
+class BucketPointSet : public kdtree::PointSet
+{
+public:
+    BucketPointSet()
+        : kdtree::PointSet(options())
+    {
+    }
+
+    BucketPointSet(const std::string & filename)
+        : kdtree::PointSet(filename, options())
+    {
+    }
+
+private:
+    static kdtree::BuildOptions options()
+    {
+        kdtree::BuildOptions result;
+        result.leaf_size = 16;
+        return result;
+    }
+};
+
+bench::Distribution get_distribution(const benchmark::State & state)
+{
+    return static_cast<bench::Distribution>(state.range(0));
+}
+
+std::size_t get_size(const benchmark::State & state)
+{
+    return static_cast<std::size_t>(state.range(1));
+}
+
+const std::vector<Point> & get_points(const benchmark::State & state)
+{
+    static std::map<std::pair<bench::Distribution, std::size_t>, std::vector<Point>> cache;
+    const auto key = std::make_pair(get_distribution(state), get_size(state));
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        it = cache.emplace(key, bench::generate_points(key.first, key.second, points_seed)).first;
+    }
+    return it->second;
+}
+
+template <class Set>
+void fill(Set & set, const std::vector<Point> & points)
+{
+    for (const Point & point : points) {
+        set.put(point);
+    }
+}
+
+// The static index moves its array on every put, it is built from the whole batch
+void fill(zorder::PointSet & set, const std::vector<Point> & points)
+{
+    set.put_range(points);
+}
+
+// Sets are built once per workload and shared by the query benchmarks
+template <class Set>
+const Set & get_set(const benchmark::State & state)
+{
+    static std::map<std::pair<bench::Distribution, std::size_t>, std::unique_ptr<Set>> cache;
+    const auto key = std::make_pair(get_distribution(state), get_size(state));
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        auto set = std::make_unique<Set>();
+        fill(*set, get_points(state));
+        it = cache.emplace(key, std::move(set)).first;
+    }
+    return *it->second;
+}
+
+#ifdef BENCH_HAS_MALLINFO2
+// Bytes allocated from the heap, including the large blocks mapped by malloc
+std::size_t heap_in_use()
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+#endif
+
+// Creates an empty file for the benchmark to write, returns an empty name on failure
+std::string temporary_file()
+{
+#ifdef BENCH_HAS_MKSTEMP
+    char filename[] = "/tmp/2d_tree_bench_XXXXXX";
+    const int fd = mkstemp(filename);
+    if (fd < 0) {
+        return {};
+    }
+    close(fd);
+    return filename;
+#else
+    const std::string filename = "2d_tree_bench_points.txt";
+    std::FILE * file = std::fopen(filename.c_str(), "w");
+    if (file == nullptr) {
+        return {};
+    }
+    std::fclose(file);
+    return filename;
+#endif
+}
+
+const std::vector<Point> & get_queries()
+{
+    static const std::vector<Point> queries = bench::generate_points(bench::Distribution::Uniform, query_count, queries_seed);
+    return queries;
+}
+
+void set_label(benchmark::State & state)
+{
+    state.SetLabel(bench::name(get_distribution(state)));
+}
+
+template <class Set>
+void BM_BuildFromFile(benchmark::State & state)
+{
+    const std::string filename = temporary_file();
+    if (filename.empty()) {
+        state.SkipWithError("can not create a temporary file");
+        return;
+    }
+    bench::write_points(filename, get_points(state));
+    for (auto _ : state) {
+        Set set(filename);
+        benchmark::DoNotOptimize(set.size());
+    }
+    std::remove(filename.c_str());
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(get_size(state)));
+    set_label(state);
+}
+
+template <class Set>
+void BM_Put(benchmark::State & state)
+{
+    const std::vector<Point> & points = get_points(state);
+    for (auto _ : state) {
+        Set set;
+        for (const Point & point : points) {
+            set.put(point);
+        }
+        benchmark::DoNotOptimize(set.size());
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(points.size()));
+    set_label(state);
+}
+
+// Reports the heap taken by a set built from the points, where the heap statistics are available
+template <class Set>
+void BM_Footprint(benchmark::State & state)
+{
+    const std::vector<Point> & points = get_points(state);
+#ifdef BENCH_HAS_MALLINFO2
+    std::size_t bytes = 0;
+    for (auto _ : state) {
+        const std::size_t before = heap_in_use();
+        Set set;
+        fill(set, points);
+        bytes = heap_in_use() - before;
+        benchmark::DoNotOptimize(set.size());
+    }
+    state.counters["bytes_per_point"] = static_cast<double>(bytes) / static_cast<double>(points.size());
+#else
+    for (auto _ : state) {
+        Set set;
+        fill(set, points);
+        benchmark::DoNotOptimize(set.size());
+    }
+#endif
+    set_label(state);
+}
+
+// Half of the probes are points of the set, half are random points
+template <class Set>
+void BM_Contains(benchmark::State & state)
+{
+    const Set & set = get_set<Set>(state);
+    const std::vector<Point> & points = get_points(state);
+    const std::vector<Point> & queries = get_queries();
+    std::size_t i = 0;
+    for (auto _ : state) {
+        const Point & probe = (i % 2 == 0) ? points[(i / 2) % points.size()] : queries[(i / 2) % queries.size()];
+        benchmark::DoNotOptimize(set.contains(probe));
+        ++i;
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_label(state);
+}
+
+// The third argument is the fraction of the unit square covered by a rect in parts per million
+template <class Set>
+void BM_Range(benchmark::State & state)
+{
+    const Set & set = get_set<Set>(state);
+    const std::vector<Rect> rects = bench::generate_rects(static_cast<double>(state.range(2)) / 1e6, query_count, queries_seed);
+    std::size_t i = 0;
+    std::size_t found = 0;
+    for (auto _ : state) {
+        const auto range = set.range(rects[i++ % rects.size()]);
+        for (auto it = range.first; it != range.second; ++it) {
+            benchmark::DoNotOptimize(*it);
+            ++found;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["points"] = benchmark::Counter(static_cast<double>(found), benchmark::Counter::kAvgIterations);
+    set_label(state);
+}
+
+template <class Set>
+void BM_Nearest(benchmark::State & state)
+{
+    const Set & set = get_set<Set>(state);
+    const std::vector<Point> & queries = get_queries();
+    std::size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(set.nearest(queries[i++ % queries.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_label(state);
+}
+
+// Nearest points of a uniform set of the same size as the set, the join pays off when
+// the queries are dense. Items are the queries, comparable to BM_Nearest.
+template <class Set>
+void BM_NearestJoin(benchmark::State & state)
+{
+    const Set & set = get_set<Set>(state);
+    Set queries;
+    queries.put_range(bench::generate_points(bench::Distribution::Uniform, get_size(state), queries_seed));
+    std::vector<std::pair<Point, Point>> result;
+    for (auto _ : state) {
+        queries.nearest_join(set, result);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(queries.size()));
+    set_label(state);
+}
+
+// The third argument is k
+template <class Set>
+void BM_KNearest(benchmark::State & state)
+{
+    const Set & set = get_set<Set>(state);
+    const std::vector<Point> & queries = get_queries();
+    const auto k = static_cast<std::size_t>(state.range(2));
+    std::size_t i = 0;
+    for (auto _ : state) {
+        const auto result = set.nearest(queries[i++ % queries.size()], k);
+        for (auto it = result.first; it != result.second; ++it) {
+            benchmark::DoNotOptimize(*it);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    set_label(state);
+}
+
+const std::vector<std::int64_t> distributions = {
+        static_cast<std::int64_t>(bench::Distribution::Uniform),
+        static_cast<std::int64_t>(bench::Distribution::Clustered),
+        static_cast<std::int64_t>(bench::Distribution::Duplicates)};
+const std::vector<std::int64_t> sizes = {1 << 14, 1 << 18};
+
+void workloads(benchmark::internal::Benchmark * benchmark)
+{
+    for (const std::int64_t distribution : distributions) {
+        for (const std::int64_t size : sizes) {
+            benchmark->Args({distribution, size});
+        }
+    }
+}
+
+void workloads_with(benchmark::internal::Benchmark * benchmark, const std::vector<std::int64_t> & parameters)
+{
+    for (const std::int64_t distribution : distributions) {
+        for (const std::int64_t size : sizes) {
+            for (const std::int64_t parameter : parameters) {
+                benchmark->Args({distribution, size, parameter});
+            }
+        }
+    }
+}
+
+void selectivities(benchmark::internal::Benchmark * benchmark)
+{
+    workloads_with(benchmark, {10, 1000, 100000});
+}
+
+void neighbour_counts(benchmark::internal::Benchmark * benchmark)
+{
+    workloads_with(benchmark, {1, 10, 100});
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_BuildFromFile, rbtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_BuildFromFile, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_BuildFromFile, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_BuildFromFile, zorder::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Footprint, rbtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Footprint, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Footprint, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Footprint, zorder::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Put, rbtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Put, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Put, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Contains, rbtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Contains, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Contains, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Contains, zorder::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Range, rbtree::PointSet)->Apply(selectivities)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Range, kdtree::PointSet)->Apply(selectivities)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Range, BucketPointSet)->Apply(selectivities)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Range, zorder::PointSet)->Apply(selectivities)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_Nearest, rbtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Nearest, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Nearest, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_Nearest, zorder::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_NearestJoin, kdtree::PointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_NearestJoin, BucketPointSet)->Apply(workloads)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_TEMPLATE(BM_KNearest, rbtree::PointSet)->Apply(neighbour_counts)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_KNearest, kdtree::PointSet)->Apply(neighbour_counts)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_KNearest, BucketPointSet)->Apply(neighbour_counts)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_KNearest, zorder::PointSet)->Apply(neighbour_counts)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
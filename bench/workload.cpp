@@ -0,0 +1,107 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+namespace {
+
+constexpr std::size_t cluster_count = 32;
+constexpr std::size_t grid_size = 256;
+constexpr double pi = 3.14159265358979323846;
+
+// Uniform in [0, 1) from the top 53 bits, std::mt19937_64 itself is fully specified
+double uniform(std::mt19937_64 & rng)
+{
+    return static_cast<double>(rng() >> 11) * 0x1p-53;
+}
+
+// Box-Muller transform
+double normal(std::mt19937_64 & rng)
+{
+    const double radius = std::sqrt(-2 * std::log(1 - uniform(rng)));
+    return radius * std::cos(2 * pi * uniform(rng));
+}
+
+double clamp_to_square(const double x)
+{
+    return std::min(std::max(x, 0.0), std::nextafter(1.0, 0.0));
+}
+
+} // namespace
+
+const char * bench::name(const Distribution distribution)
+{
+    switch (distribution) {
+    case Distribution::Uniform: return "uniform";
+    case Distribution::Clustered: return "clustered";
+    case Distribution::Duplicates: return "duplicates";
+    default: return "unknown";
+    }
+}
+
+std::vector<Point> bench::generate_points(const Distribution distribution, const std::size_t count, const std::uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<Point> points;
+    points.reserve(count);
+    switch (distribution) {
+    case Distribution::Uniform:
+        for (std::size_t i = 0; i < count; ++i) {
+            const double x = uniform(rng);
+            points.emplace_back(x, uniform(rng));
+        }
+        break;
+    case Distribution::Clustered: {
+        std::vector<Point> centers;
+        std::vector<double> sigmas;
+        for (std::size_t i = 0; i < cluster_count; ++i) {
+            const double x = uniform(rng);
+            centers.emplace_back(x, uniform(rng));
+            sigmas.push_back(0.001 + 0.02 * uniform(rng));
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            const std::size_t cluster = static_cast<std::size_t>(rng() % cluster_count);
+            const double x = clamp_to_square(centers[cluster].x() + sigmas[cluster] * normal(rng));
+            points.emplace_back(x, clamp_to_square(centers[cluster].y() + sigmas[cluster] * normal(rng)));
+        }
+        break;
+    }
+    case Distribution::Duplicates:
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto x = static_cast<double>(rng() % grid_size) / grid_size;
+            points.emplace_back(x, static_cast<double>(rng() % grid_size) / grid_size);
+        }
+        break;
+    }
+    return points;
+}
+
+std::vector<Rect> bench::generate_rects(const double selectivity, const std::size_t count, const std::uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    const double side = std::sqrt(selectivity);
+    std::vector<Rect> rects;
+    rects.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        const double x = uniform(rng) * (1 - side);
+        const double y = uniform(rng) * (1 - side);
+        rects.emplace_back(Point(x, y), Point(x + side, y + side));
+    }
+    return rects;
+}
+
+void bench::write_points(const std::string & filename, const std::vector<Point> & points)
+{
+    std::ofstream file(filename, std::ios::trunc);
+    file.precision(std::numeric_limits<double>::max_digits10);
+    for (const Point & point : points) {
+        file << point.x() << ' ' << point.y() << '\n';
+    }
+    if (!file) {
+        throw std::runtime_error("bench: can not write " + filename);
+    }
+}
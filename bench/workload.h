@@ -0,0 +1,31 @@
+#pragma once
+
+#include "primitives.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+enum class Distribution
+{
+    Uniform,
+    // Gaussian clusters of different density
+    Clustered,
+    // Points snapped to a coarse grid, most of them are repeated
+    Duplicates
+};
+
+const char * name(Distribution distribution);
+
+// Points in the unit square. The generator does not use the standard distributions,
+// which differ between standard libraries, so a seed gives the same points everywhere.
+std::vector<Point> generate_points(Distribution distribution, std::size_t count, std::uint64_t seed);
+// Squares inside the unit square, each covering the given fraction of it
+std::vector<Rect> generate_rects(double selectivity, std::size_t count, std::uint64_t seed);
+
+// Writes the points as "x y" lines readable by the PointSet constructors
+void write_points(const std::string & filename, const std::vector<Point> & points);
+
+} // namespace bench
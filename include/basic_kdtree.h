@@ -0,0 +1,659 @@
+#pragma once
+
+#include "primitives.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace kdtree {
+
+// Point with K coordinates of type T. Narrow or quantised coordinates make the
+// trees smaller, the distances of integer points are computed in double.
+template <class T, std::size_t K>
+class BasicPoint
+{
+    static_assert(std::is_arithmetic_v<T>, "Coordinates should be numbers");
+    static_assert(K > 0, "Points should have at least one coordinate");
+
+public:
+    using value_type = T;
+    using distance_type = std::conditional_t<std::is_floating_point_v<T>, T, double>;
+
+    constexpr static const std::size_t dimension = K;
+
+    BasicPoint() = default;
+    BasicPoint(const std::array<T, K> & coordinates);
+    template <class... Ts, std::enable_if_t<sizeof...(Ts) == K && (std::is_convertible_v<Ts, T> && ...), int> = 0>
+    BasicPoint(Ts... coordinates);
+
+    T operator[](std::size_t axis) const;
+    distance_type distance(const BasicPoint & other) const;
+    distance_type sqr_distance(const BasicPoint & other) const;
+
+    // Coordinates are compared exactly
+    bool operator<(const BasicPoint & other) const;
+    bool operator==(const BasicPoint & other) const;
+    bool operator!=(const BasicPoint & other) const;
+
+private:
+    std::array<T, K> m_coordinates{};
+};
+
+// Box with closed bounds, unlike Rect the bounds are compared exactly
+template <class T, std::size_t K>
+class BasicRect
+{
+public:
+    using point_type = BasicPoint<T, K>;
+    using distance_type = typename point_type::distance_type;
+
+    BasicRect(const point_type & min, const point_type & max);
+
+    const point_type & min() const;
+    const point_type & max() const;
+    distance_type sqr_distance(const point_type & point) const;
+
+    bool contains(const point_type & point) const;
+    bool intersects(const BasicRect & other) const;
+
+private:
+    point_type m_min;
+    point_type m_max;
+};
+
+// Scapegoat kd-tree over BasicPoint. The split axis of every level is a template
+// argument, so the traversals compare a fixed coordinate without a runtime switch.
+// While PointSet is tuned for the plane, this one trades its buckets, erasure and
+// files for any number of dimensions and 20 bytes per node with 2D float points.
+// PointSet is the canonical engine: fixes and features land there first and are ported
+// here where they apply. Both split the subtrees with detail::split_less() and keep the
+// nearest candidates with detail::offer_candidate(), so BasicPointSet<double, 2> finds the
+// same points as PointSet, except that of equally distant nearest points it may keep
+// another one. The range search differs as this tree keeps no bounding rects: it descends
+// by the split coordinate and visits both subtrees of a median equal to the rect bound.
+template <class T, std::size_t K>
+class BasicPointSet
+{
+public:
+    using point_type = BasicPoint<T, K>;
+    using rect_type = BasicRect<T, K>;
+    using distance_type = typename point_type::distance_type;
+
+private:
+    using index_t = std::uint32_t;
+
+    constexpr static const index_t nil = std::numeric_limits<index_t>::max();
+
+    // Nodes live in a pool owned by the set and refer to each other by index
+    struct Node
+    {
+        point_type point;
+
+        index_t left = nil;
+        index_t right = nil;
+        index_t size = 1;
+    };
+
+public:
+    // Walks the pool in storage order
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = point_type;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using iterator_category = std::forward_iterator_tag;
+
+        iterator() = default;
+
+        reference operator*() const { return m_node->point; }
+        pointer operator->() const { return &m_node->point; }
+        iterator & operator++()
+        {
+            ++m_node;
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator result = *this;
+            ++m_node;
+            return result;
+        }
+
+        friend bool operator==(const iterator & lhs, const iterator & rhs) { return lhs.m_node == rhs.m_node; }
+        friend bool operator!=(const iterator & lhs, const iterator & rhs) { return !(lhs == rhs); }
+
+        friend class BasicPointSet;
+
+    private:
+        iterator(const Node * node)
+            : m_node(node)
+        {
+        }
+
+        const Node * m_node = nullptr;
+    };
+
+    BasicPointSet() = default;
+    // Builds a balanced tree, duplicates are dropped
+    BasicPointSet(std::vector<point_type> points);
+
+    bool empty() const;
+    std::size_t size() const;
+    void put(const point_type & point);
+    bool contains(const point_type & point) const;
+
+    iterator begin() const;
+    iterator end() const;
+
+    std::vector<point_type> range(const rect_type & rect) const;
+    std::optional<point_type> nearest(const point_type & point) const;
+    // In order of increasing distance
+    std::vector<point_type> nearest(const point_type & point, std::size_t k) const;
+
+    // Calls the visitor for every point inside the rect
+    template <class F>
+    void range_for_each(const rect_type & rect, F && visitor) const;
+    // Calls the visitor for the k nearest points in order of increasing distance
+    template <class F>
+    void nearest_for_each(const point_type & point, std::size_t k, F && visitor) const;
+
+private:
+    // The split order of PointSet, see detail::split_less()
+    template <std::size_t Axis>
+    static bool less(const point_type & lhs, const point_type & rhs);
+    constexpr static std::size_t next_axis(std::size_t axis);
+
+    index_t get_size(index_t node) const;
+    bool balanced(index_t root) const;
+
+    // Builds the subtree of the points taking the node indices from slots in preorder
+    template <std::size_t Axis>
+    index_t build(typename std::vector<point_type>::iterator begin,
+                  typename std::vector<point_type>::iterator end,
+                  const index_t *& slots);
+    // Collects the node indices of the subtree in preorder
+    void collect(index_t root, std::vector<index_t> & slots) const;
+    template <std::size_t Axis>
+    index_t rebuild_tree(index_t root);
+    // Returns the new root of the subtree, deep is set when the point lands too deep
+    // for the size of the tree and is cleared by the rebuild of its scapegoat
+    template <std::size_t Axis>
+    index_t insert(index_t root, const point_type & point, std::size_t depth, bool & deep);
+
+    template <std::size_t Axis>
+    bool contains(index_t root, const point_type & point) const;
+    // Returns false once the visitor stops the traversal
+    template <std::size_t Axis, class F>
+    bool range_for_each(index_t root, const rect_type & rect, F & visitor) const;
+    // Squared distance to the point and the candidate
+    using candidate_t = std::pair<distance_type, const point_type *>;
+
+    static bool closer(const candidate_t & lhs, const candidate_t & rhs);
+
+    // Branch-and-bound k nearest search, offsets are the distances from the point to the
+    // cell of the subtree by every axis and sqr_bound is the sum of their squares.
+    // heap is a max-heap by distance to the point.
+    template <std::size_t Axis>
+    void nearest(index_t root,
+                 const point_type & point,
+                 std::size_t k,
+                 std::array<distance_type, K> & offsets,
+                 distance_type sqr_bound,
+                 std::vector<candidate_t> & heap) const;
+    std::vector<candidate_t> k_nearest(const point_type & point, std::size_t k) const;
+
+    constexpr static const double alpha = 0.65;
+
+    std::vector<Node> m_nodes;
+    index_t m_root = nil;
+};
+
+using PointSet2f = BasicPointSet<float, 2>;
+using PointSet2i = BasicPointSet<std::int32_t, 2>;
+using PointSet3f = BasicPointSet<float, 3>;
+using PointSet3d = BasicPointSet<double, 3>;
+
+template <class T, std::size_t K>
+BasicPoint<T, K>::BasicPoint(const std::array<T, K> & coordinates)
+    : m_coordinates(coordinates)
+{
+}
+
+template <class T, std::size_t K>
+template <class... Ts, std::enable_if_t<sizeof...(Ts) == K && (std::is_convertible_v<Ts, T> && ...), int>>
+BasicPoint<T, K>::BasicPoint(Ts... coordinates)
+    : m_coordinates{static_cast<T>(coordinates)...}
+{
+}
+
+template <class T, std::size_t K>
+T BasicPoint<T, K>::operator[](const std::size_t axis) const
+{
+    return m_coordinates[axis];
+}
+
+template <class T, std::size_t K>
+auto BasicPoint<T, K>::distance(const BasicPoint & other) const -> distance_type
+{
+    return std::sqrt(sqr_distance(other));
+}
+
+template <class T, std::size_t K>
+auto BasicPoint<T, K>::sqr_distance(const BasicPoint & other) const -> distance_type
+{
+    // summed as in Point::sqr_distance(), so that the 2D double points round the same way
+    auto sqr_diff = [this, &other](const std::size_t axis) {
+        const distance_type diff = static_cast<distance_type>(m_coordinates[axis]) - static_cast<distance_type>(other.m_coordinates[axis]);
+        return diff * diff;
+    };
+    distance_type result = sqr_diff(0);
+    for (std::size_t axis = 1; axis < K; ++axis) {
+        result += sqr_diff(axis);
+    }
+    return result;
+}
+
+template <class T, std::size_t K>
+bool BasicPoint<T, K>::operator<(const BasicPoint & other) const
+{
+    return m_coordinates < other.m_coordinates;
+}
+
+template <class T, std::size_t K>
+bool BasicPoint<T, K>::operator==(const BasicPoint & other) const
+{
+    return m_coordinates == other.m_coordinates;
+}
+
+template <class T, std::size_t K>
+bool BasicPoint<T, K>::operator!=(const BasicPoint & other) const
+{
+    return !(*this == other);
+}
+
+template <class T, std::size_t K>
+std::ostream & operator<<(std::ostream & ostream, const BasicPoint<T, K> & point)
+{
+    ostream << "Point(";
+    for (std::size_t axis = 0; axis < K; ++axis) {
+        if (axis != 0) {
+            ostream << "; ";
+        }
+        ostream << +point[axis];
+    }
+    return ostream << ")";
+}
+
+template <class T, std::size_t K>
+BasicRect<T, K>::BasicRect(const point_type & min, const point_type & max)
+    : m_min(min)
+    , m_max(max)
+{
+}
+
+template <class T, std::size_t K>
+auto BasicRect<T, K>::min() const -> const point_type &
+{
+    return m_min;
+}
+
+template <class T, std::size_t K>
+auto BasicRect<T, K>::max() const -> const point_type &
+{
+    return m_max;
+}
+
+template <class T, std::size_t K>
+auto BasicRect<T, K>::sqr_distance(const point_type & point) const -> distance_type
+{
+    distance_type result = 0;
+    for (std::size_t axis = 0; axis < K; ++axis) {
+        const auto coordinate = static_cast<distance_type>(point[axis]);
+        const distance_type diff = std::max({static_cast<distance_type>(m_min[axis]) - coordinate,
+                                             distance_type(0),
+                                             coordinate - static_cast<distance_type>(m_max[axis])});
+        result += diff * diff;
+    }
+    return result;
+}
+
+template <class T, std::size_t K>
+bool BasicRect<T, K>::contains(const point_type & point) const
+{
+    for (std::size_t axis = 0; axis < K; ++axis) {
+        if (point[axis] < m_min[axis] || m_max[axis] < point[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <class T, std::size_t K>
+bool BasicRect<T, K>::intersects(const BasicRect & other) const
+{
+    for (std::size_t axis = 0; axis < K; ++axis) {
+        if (other.m_max[axis] < m_min[axis] || m_max[axis] < other.m_min[axis]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <class T, std::size_t K>
+BasicPointSet<T, K>::BasicPointSet(std::vector<point_type> points)
+{
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    if (points.empty()) {
+        return;
+    }
+    if (points.size() >= nil) {
+        throw std::length_error("Too many points for a kd-tree");
+    }
+    m_nodes.resize(points.size());
+    std::vector<index_t> slots(points.size());
+    for (std::size_t i = 0; i < slots.size(); ++i) {
+        slots[i] = static_cast<index_t>(i);
+    }
+    const index_t * slot = slots.data();
+    m_root = build<0>(points.begin(), points.end(), slot);
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+bool BasicPointSet<T, K>::less(const point_type & lhs, const point_type & rhs)
+{
+    return detail::split_less<K, Axis>(lhs, rhs);
+}
+
+template <class T, std::size_t K>
+constexpr std::size_t BasicPointSet<T, K>::next_axis(const std::size_t axis)
+{
+    return (axis + 1) % K;
+}
+
+template <class T, std::size_t K>
+bool BasicPointSet<T, K>::empty() const
+{
+    return size() == 0;
+}
+
+template <class T, std::size_t K>
+std::size_t BasicPointSet<T, K>::size() const
+{
+    return get_size(m_root);
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::get_size(const index_t node) const -> index_t
+{
+    return (node != nil) ? m_nodes[node].size : 0;
+}
+
+template <class T, std::size_t K>
+bool BasicPointSet<T, K>::balanced(const index_t root) const
+{
+    const Node & node = m_nodes[root];
+    return get_size(node.left) <= alpha * node.size && get_size(node.right) <= alpha * node.size;
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+auto BasicPointSet<T, K>::build(const typename std::vector<point_type>::iterator begin,
+                                const typename std::vector<point_type>::iterator end,
+                                const index_t *& slots) -> index_t
+{
+    if (begin == end) {
+        return nil;
+    }
+    const auto middle = begin + (end - begin) / 2;
+    std::nth_element(begin, middle, end, less<Axis>);
+    const index_t index = *slots++;
+    m_nodes[index].point = *middle;
+    m_nodes[index].size = static_cast<index_t>(end - begin);
+    m_nodes[index].left = build<next_axis(Axis)>(begin, middle, slots);
+    m_nodes[index].right = build<next_axis(Axis)>(middle + 1, end, slots);
+    return index;
+}
+
+template <class T, std::size_t K>
+void BasicPointSet<T, K>::collect(const index_t root, std::vector<index_t> & slots) const
+{
+    if (root == nil) {
+        return;
+    }
+    slots.push_back(root);
+    collect(m_nodes[root].left, slots);
+    collect(m_nodes[root].right, slots);
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+auto BasicPointSet<T, K>::rebuild_tree(const index_t root) -> index_t
+{
+    std::vector<index_t> slots;
+    slots.reserve(m_nodes[root].size);
+    collect(root, slots);
+    std::vector<point_type> points;
+    points.reserve(slots.size());
+    for (const index_t index : slots) {
+        points.push_back(m_nodes[index].point);
+    }
+    const index_t * slot = slots.data();
+    return build<Axis>(points.begin(), points.end(), slot);
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+auto BasicPointSet<T, K>::insert(const index_t root, const point_type & point, const std::size_t depth, bool & deep) -> index_t
+{
+    if (root == nil) {
+        m_nodes.push_back({point});
+        const double max_depth = std::log(static_cast<double>(m_nodes.size())) / std::log(1 / alpha);
+        deep = static_cast<double>(depth) > max_depth;
+        return static_cast<index_t>(m_nodes.size() - 1);
+    }
+    if (less<Axis>(point, m_nodes[root].point)) {
+        const index_t child = insert<next_axis(Axis)>(m_nodes[root].left, point, depth + 1, deep);
+        m_nodes[root].left = child;
+    }
+    else {
+        const index_t child = insert<next_axis(Axis)>(m_nodes[root].right, point, depth + 1, deep);
+        m_nodes[root].right = child;
+    }
+    ++m_nodes[root].size;
+    if (deep && !balanced(root)) {
+        deep = false;
+        return rebuild_tree<Axis>(root);
+    }
+    return root;
+}
+
+template <class T, std::size_t K>
+void BasicPointSet<T, K>::put(const point_type & point)
+{
+    if (contains(point)) {
+        return;
+    }
+    if (m_nodes.size() + 1 >= nil) {
+        throw std::length_error("Too many points for a kd-tree");
+    }
+    bool deep = false;
+    m_root = insert<0>(m_root, point, 0, deep);
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+bool BasicPointSet<T, K>::contains(const index_t root, const point_type & point) const
+{
+    if (root == nil) {
+        return false;
+    }
+    if (m_nodes[root].point == point) {
+        return true;
+    }
+    const Node & node = m_nodes[root];
+    return contains<next_axis(Axis)>(less<Axis>(point, m_nodes[root].point) ? node.left : node.right, point);
+}
+
+template <class T, std::size_t K>
+bool BasicPointSet<T, K>::contains(const point_type & point) const
+{
+    return contains<0>(m_root, point);
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::begin() const -> iterator
+{
+    return iterator(m_nodes.data());
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::end() const -> iterator
+{
+    return iterator(m_nodes.data() + m_nodes.size());
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis, class F>
+bool BasicPointSet<T, K>::range_for_each(const index_t root, const rect_type & rect, F & visitor) const
+{
+    if (root == nil) {
+        return true;
+    }
+    const point_type & median = m_nodes[root].point;
+    if (rect.contains(median) && !detail::visit(visitor, median)) {
+        return false;
+    }
+    // points equal to the median by the axis may be in both subtrees
+    const Node & node = m_nodes[root];
+    if (!(median[Axis] < rect.min()[Axis]) && !range_for_each<next_axis(Axis)>(node.left, rect, visitor)) {
+        return false;
+    }
+    return rect.max()[Axis] < median[Axis] || range_for_each<next_axis(Axis)>(node.right, rect, visitor);
+}
+
+template <class T, std::size_t K>
+template <class F>
+void BasicPointSet<T, K>::range_for_each(const rect_type & rect, F && visitor) const
+{
+    range_for_each<0>(m_root, rect, visitor);
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::range(const rect_type & rect) const -> std::vector<point_type>
+{
+    std::vector<point_type> result;
+    range_for_each(rect, [&result](const point_type & point) {
+        result.push_back(point);
+    });
+    return result;
+}
+
+template <class T, std::size_t K>
+template <std::size_t Axis>
+void BasicPointSet<T, K>::nearest(const index_t root,
+                                  const point_type & point,
+                                  const std::size_t k,
+                                  std::array<distance_type, K> & offsets,
+                                  const distance_type sqr_bound,
+                                  std::vector<candidate_t> & heap) const
+{
+    if (root == nil || (heap.size() == k && !(sqr_bound < heap.front().first))) {
+        return;
+    }
+    const point_type & median = m_nodes[root].point;
+    detail::offer_candidate(heap, k, candidate_t(point.sqr_distance(median), &median), closer);
+    const Node & node = m_nodes[root];
+    const bool go_left = less<Axis>(point, median);
+    nearest<next_axis(Axis)>(go_left ? node.left : node.right, point, k, offsets, sqr_bound, heap);
+    // the far cell is beyond the split by the axis, the offsets by the other axes stay
+    const distance_type offset = static_cast<distance_type>(point[Axis]) - static_cast<distance_type>(median[Axis]);
+    const distance_type old_offset = offsets[Axis];
+    offsets[Axis] = offset;
+    nearest<next_axis(Axis)>(go_left ? node.right : node.left,
+                             point,
+                             k,
+                             offsets,
+                             sqr_bound - old_offset * old_offset + offset * offset,
+                             heap);
+    offsets[Axis] = old_offset;
+}
+
+template <class T, std::size_t K>
+bool BasicPointSet<T, K>::closer(const candidate_t & lhs, const candidate_t & rhs)
+{
+    return lhs.first < rhs.first;
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::k_nearest(const point_type & point, const std::size_t k) const -> std::vector<candidate_t>
+{
+    std::vector<candidate_t> heap;
+    if (k == 0) {
+        return heap;
+    }
+    heap.reserve(std::min(k, size()));
+    std::array<distance_type, K> offsets{};
+    nearest<0>(m_root, point, k, offsets, 0, heap);
+    return heap;
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::nearest(const point_type & point) const -> std::optional<point_type>
+{
+    const std::vector<candidate_t> heap = k_nearest(point, 1);
+    return heap.empty() ? std::optional<point_type>() : std::optional<point_type>(*heap.front().second);
+}
+
+template <class T, std::size_t K>
+template <class F>
+void BasicPointSet<T, K>::nearest_for_each(const point_type & point, const std::size_t k, F && visitor) const
+{
+    std::vector<candidate_t> heap = k_nearest(point, k);
+    std::sort_heap(heap.begin(), heap.end(), closer);
+    for (const candidate_t & candidate : heap) {
+        if (!detail::visit(visitor, *candidate.second)) {
+            return;
+        }
+    }
+}
+
+template <class T, std::size_t K>
+auto BasicPointSet<T, K>::nearest(const point_type & point, const std::size_t k) const -> std::vector<point_type>
+{
+    std::vector<point_type> result;
+    result.reserve(std::min(k, size()));
+    nearest_for_each(point, k, [&result](const point_type & candidate) {
+        result.push_back(candidate);
+    });
+    return result;
+}
+
+template <class T, std::size_t K>
+std::ostream & operator<<(std::ostream & ostream, const BasicPointSet<T, K> & point_set)
+{
+    ostream << "PointSet(";
+    for (auto it = point_set.begin(), end = point_set.end(); it != end; ++it) {
+        if (it != point_set.begin()) {
+            ostream << ", ";
+        }
+        ostream << *it;
+    }
+    ostream << ")";
+    return ostream;
+}
+
+} // namespace kdtree
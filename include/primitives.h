@@ -1,10 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -16,6 +23,7 @@ public:
     double x() const;
     double y() const;
     double distance(const Point & other) const;
+    double sqr_distance(const Point & other) const;
 
     enum class Quadrant
     {
@@ -55,15 +63,150 @@ public:
     double xmax() const;
     double ymax() const;
     double distance(const Point & point) const;
-
+    // The tests below are inlined and branch-free, they are on the innermost path of the
+    // tree traversals. sqr_distance() is exact, while contains() widens the rect by EPS,
+    // so a point within EPS outside the rect is contained but at a tiny positive distance.
+    double sqr_distance(const Point & point) const;
     bool contains(const Point & point) const;
+    bool contains(const Rect & other) const;
     bool intersects(const Rect & other) const;
 
 private:
+    constexpr static const double EPS = std::numeric_limits<double>::epsilon();
+
     Point m_left_bottom;
     Point m_right_top;
 };
 
+inline double Point::x() const
+{
+    return m_x;
+}
+
+inline double Point::y() const
+{
+    return m_y;
+}
+
+inline double Point::sqr(double x)
+{
+    return x * x;
+}
+
+inline double Point::sqr_distance(const Point & other) const
+{
+    return sqr(m_x - other.m_x) + sqr(m_y - other.m_y);
+}
+
+inline double Rect::xmin() const
+{
+    return m_left_bottom.x();
+}
+
+inline double Rect::ymin() const
+{
+    return m_left_bottom.y();
+}
+
+inline double Rect::xmax() const
+{
+    return m_right_top.x();
+}
+
+inline double Rect::ymax() const
+{
+    return m_right_top.y();
+}
+
+inline double Rect::sqr_distance(const Point & point) const
+{
+    const double dx = std::max(std::max(xmin() - point.x(), 0.0), point.x() - xmax());
+    const double dy = std::max(std::max(ymin() - point.y(), 0.0), point.y() - ymax());
+    return dx * dx + dy * dy;
+}
+
+inline bool Rect::contains(const Point & point) const
+{
+    return (point.x() > xmin() - EPS) & (point.x() < xmax() + EPS) &
+            (point.y() > ymin() - EPS) & (point.y() < ymax() + EPS);
+}
+
+inline bool Rect::intersects(const Rect & other) const
+{
+    return !((other.ymin() > ymax()) | (other.ymax() < ymin()) | (other.xmin() > xmax()) | (other.xmax() < xmin()));
+}
+
+namespace detail {
+
+// Visitors may return bool, returning false stops the traversal
+template <class F, class P>
+bool visit(F & visitor, const P & point)
+{
+    if constexpr (std::is_void_v<std::invoke_result_t<F &, const P &>>) {
+        visitor(point);
+        return true;
+    }
+    else {
+        return static_cast<bool>(visitor(point));
+    }
+}
+
+// Coordinate of the point by the axis, the axis 0 is x
+inline double coordinate(const Point & point, const std::size_t axis)
+{
+    return (axis == 0) ? point.x() : point.y();
+}
+
+template <class P>
+auto coordinate(const P & point, const std::size_t axis) -> decltype(point[axis])
+{
+    return point[axis];
+}
+
+// Split order of the kd-trees: by the coordinate of the axis and then by the following ones,
+// so that distinct points never tie and every subtree is split exactly at its median
+template <std::size_t K, std::size_t Axis, class P>
+bool split_less(const P & lhs, const P & rhs)
+{
+    for (std::size_t i = 0, axis = Axis; i < K; ++i, axis = (axis + 1) % K) {
+        if (coordinate(lhs, axis) < coordinate(rhs, axis)) {
+            return true;
+        }
+        if (coordinate(rhs, axis) < coordinate(lhs, axis)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Keeps the k closest of the offered candidates in a max-heap by closer, of equally close
+// candidates the one offered first stays. Shared by the nearest searches of the kd-trees.
+template <class C, class Closer>
+void offer_candidate(std::vector<C> & heap, const std::size_t k, const C & candidate, Closer closer)
+{
+    if (heap.size() < k) {
+        heap.push_back(candidate);
+        std::push_heap(heap.begin(), heap.end(), closer);
+    }
+    else if (closer(candidate, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), closer);
+        heap.back() = candidate;
+        std::push_heap(heap.begin(), heap.end(), closer);
+    }
+}
+
+// Scans of point arrays with the widest vector instructions the CPU supports,
+// the results are the same as of Rect::contains() and Point::sqr_distance()
+
+// Index of the first point inside the rect starting from begin, count if there is none
+std::size_t find_in_rect(const Point * points, std::size_t begin, std::size_t count, const Rect & rect);
+std::size_t count_in_rect(const Point * points, std::size_t count, const Rect & rect);
+// Index of the first point starting from begin with the squared distance to the query
+// less than sqr_bound, count if there is none
+std::size_t find_closer(const Point * points, std::size_t begin, std::size_t count, const Point & query, double sqr_bound);
+
+} // namespace detail
+
 namespace rbtree {
 
 class PointSet
@@ -91,10 +234,27 @@ public:
         friend class PointSet;
 
     private:
-        using data_type = std::variant<std::vector<pointer>, std::set<value_type>::iterator>;
+        // Walks the set lazily and stops only at the points inside the rect
+        struct range_t
+        {
+            std::set<value_type>::iterator current;
+            std::set<value_type>::iterator end;
+            Rect rect;
+
+            friend bool operator==(const range_t & lhs, const range_t & rhs)
+            {
+                return lhs.current == rhs.current;
+            }
+        };
+
+        using data_type = std::variant<std::vector<pointer>, std::set<value_type>::iterator, range_t>;
 
         iterator(std::vector<pointer> && points);
         iterator(std::set<value_type>::iterator && it);
+        iterator(range_t && range);
+
+        // Skips the points out of the rect, the exhausted iterator becomes equal to the default one
+        void find_in_range();
 
         data_type m_data;
     };
@@ -105,23 +265,100 @@ public:
     bool empty() const;
     std::size_t size() const;
     void put(const Point &);
+    void put_range(const std::vector<Point> & points);
+    std::size_t erase(const Point &);
+    std::size_t erase(const Rect &);
     bool contains(const Point &) const;
 
     // second iterator points to an element out of range
     std::pair<iterator, iterator> range(const Rect &) const;
+    std::size_t range_count(const Rect &) const;
     iterator begin() const;
     iterator end() const;
 
     std::optional<Point> nearest(const Point &) const;
     // second iterator points to an element out of range
     std::pair<iterator, iterator> nearest(const Point & p, std::size_t k) const;
+    // The k nearest among the points at a distance of at most max_dist
+    std::pair<iterator, iterator> nearest(const Point & p, std::size_t k, double max_dist) const;
+    // Points at a distance of at most radius
+    std::pair<iterator, iterator> within_radius(const Point & p, double radius) const;
+
+    // Calls the visitor for every point inside the rect
+    template <class F>
+    void range_for_each(const Rect & rect, F && visitor) const;
+    // Calls the visitor for the k nearest points in order of increasing distance
+    template <class F>
+    void nearest_for_each(const Point & point, std::size_t k, F && visitor) const;
+    // Calls the visitor for every point at a distance of at most radius
+    template <class F>
+    void within_radius_for_each(const Point & point, double radius, F && visitor) const;
 
     friend std::ostream & operator<<(std::ostream & ostream, const PointSet & point_set);
 
 private:
+    // Points with x inside the rect widened by EPS, no point outside of them can be inside the rect
+    std::pair<std::set<Point>::iterator, std::set<Point>::iterator> slab(const Rect & rect) const;
+    // Max-heap by distance to the point. The set is swept outwards from the x of the point,
+    // each side stops once its x gap alone is larger than the distance to the k-th point
+    // or than the max distance.
+    std::vector<const Point *> k_nearest(const Point & point,
+                                         std::size_t k,
+                                         double sqr_max_dist = std::numeric_limits<double>::infinity()) const;
+
     std::set<Point> m_set;
 };
 
+inline bool PointSet::empty() const
+{
+    return m_set.empty();
+}
+
+inline std::size_t PointSet::size() const
+{
+    return m_set.size();
+}
+
+template <class F>
+void PointSet::range_for_each(const Rect & rect, F && visitor) const
+{
+    const auto [begin, end] = slab(rect);
+    for (auto it = begin; it != end; ++it) {
+        if (rect.contains(*it) && !detail::visit(visitor, *it)) {
+            return;
+        }
+    }
+}
+
+template <class F>
+void PointSet::nearest_for_each(const Point & point, const std::size_t k, F && visitor) const
+{
+    std::vector<const Point *> heap = k_nearest(point, k);
+    std::sort_heap(heap.begin(), heap.end(), [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    });
+    for (const Point * candidate : heap) {
+        if (!detail::visit(visitor, *candidate)) {
+            return;
+        }
+    }
+}
+
+template <class F>
+void PointSet::within_radius_for_each(const Point & point, const double radius, F && visitor) const
+{
+    if (!(radius >= 0)) {
+        return;
+    }
+    const double sqr_radius = radius * radius;
+    const auto [begin, end] = slab(Rect(Point(point.x() - radius, point.y() - radius), Point(point.x() + radius, point.y() + radius)));
+    for (auto it = begin; it != end; ++it) {
+        if (point.sqr_distance(*it) <= sqr_radius && !detail::visit(visitor, *it)) {
+            return;
+        }
+    }
+}
+
 inline bool operator==(const rbtree::PointSet::iterator & lhs, const rbtree::PointSet::iterator & rhs)
 {
     return lhs.m_data == rhs.m_data;
@@ -148,33 +385,109 @@ inline std::ostream & operator<<(std::ostream & ostream, const rbtree::PointSet
 
 } // namespace rbtree
 
+namespace detail {
+class MappedFile;
+} // namespace detail
+
+// Counts the work of the kd-tree queries when KDTREE_STATS is defined, see kdtree::QueryStats
+#ifdef KDTREE_STATS
+#define KDTREE_COUNT(counter, n) (thread_stats().counter += (n))
+#else
+#define KDTREE_COUNT(counter, n) static_cast<void>(0)
+#endif
+
 namespace kdtree {
 
+// Work done by the kd-tree queries and updates of a thread. It is collected only when the
+// library and the code including this header are built with KDTREE_STATS and stays zero otherwise.
+struct QueryStats
+{
+    // Nodes whose point or bucket was looked at
+    std::uint64_t nodes_visited = 0;
+    // Subtrees skipped after the test of their bounding rect
+    std::uint64_t subtrees_pruned = 0;
+    // Distances from the query to the points
+    std::uint64_t distance_evaluations = 0;
+    // Subtrees rebuilt because they were unbalanced or had too many erased points,
+    // including the whole tree rebuilt by a compaction or freeze()
+    std::uint64_t rebuilds = 0;
+    // Rebuilds by the number of points, the i-th counts the sizes from 2^i to 2^(i + 1) - 1
+    std::array<std::uint64_t, 32> rebuild_sizes{};
+};
+
+struct TreeShape
+{
+    std::size_t height = 0;
+    std::size_t nodes = 0;
+    // Nodes with children by the share of the larger child in the points of the node including
+    // erased ones, the i-th counts the shares from i / 10 up to (i + 1) / 10. Subtrees with
+    // a share above alpha are rebuilt by the next update passing through them.
+    std::array<std::size_t, 10> imbalance{};
+};
+
+struct BuildOptions
+{
+    // Number of threads used to build the tree, 0 means one per hardware thread
+    std::size_t threads = 1;
+    // Subtrees smaller than this are never split between threads
+    std::size_t parallel_cutoff = 1 << 15;
+    // Leaves keep up to this many points in a contiguous bucket, 1 keeps one point per node
+    std::size_t leaf_size = 1;
+    // A subtree is rebuilt once one of its children holds more than this share of its points,
+    // from 0.5 keeping the tree perfectly balanced to 1 rebuilding only for the erased points
+    double alpha = 0.65;
+    // Updates rebuild only the subtrees of at most this many points, the larger ones and the
+    // compaction of a mostly freed pool are left for maintain(), so that no single update has
+    // to rebuild a large part of the tree.
+    // 0 leaves all the rebuilds for maintain().
+    std::size_t rebuild_limit = std::numeric_limits<std::size_t>::max();
+};
+
 class PointSet
 {
+    using index_t = std::uint32_t;
+
+    constexpr static const index_t nil = std::numeric_limits<index_t>::max();
+
+    // Nodes live in a pool owned by the PointSet and refer to each other by index
     struct Node
     {
         Node(const Point & point);
-        Node(const Node & node);
-
-        ~Node() = default;
-
-        void update_rect_by(const std::shared_ptr<Node> & node);
-        void update_data();
 
         Point point;
 
+        // Bounding rect of the points in the subtree that are not erased
         Rect rect;
 
-        std::size_t size = 1;
+        // Number of the points in the subtree that are not erased
+        index_t size = 1;
+        // Number of the points in the subtree including erased ones
+        index_t count = 1;
+
+        index_t left = nil;
+        index_t right = nil;
 
-        std::shared_ptr<Node> left;
-        std::shared_ptr<Node> right;
+        index_t parent = nil;
 
-        std::weak_ptr<Node> parent;
+        // Leaves of a tree with buckets keep count points starting from this index of the bucket
+        // storage and do not use their own point, it is nil for the nodes holding a single point
+        index_t bucket = nil;
+
+        // Erased points stay in the tree until their subtree is rebuilt
+        bool erased = false;
     };
 
-    using NodePtr = Node *;
+    // Place of a point in the tree, offset is the index in the bucket of the node
+    struct Position
+    {
+        index_t node = nil;
+        index_t offset = 0;
+
+        friend bool operator==(const Position & lhs, const Position & rhs)
+        {
+            return lhs.node == rhs.node && lhs.offset == rhs.offset;
+        }
+    };
 
 public:
     class iterator
@@ -199,72 +512,472 @@ public:
         friend class PointSet;
 
     private:
-        using node_t = NodePtr;
-        using list_t = std::vector<node_t>;
-        using data_type = std::variant<list_t, node_t>;
-
-        iterator(list_t && points);
-        iterator(node_t current);
-
+        using list_t = std::vector<pointer>;
+
+        // Depth first search over the subtrees intersecting the rect, memory is bounded by the tree height
+        struct range_t
+        {
+            Rect rect;
+            Position current;
+            std::vector<index_t> stack;
+
+            friend bool operator==(const range_t & lhs, const range_t & rhs)
+            {
+                return lhs.current == rhs.current && lhs.stack == rhs.stack;
+            }
+        };
+
+        // In-order walk, the stack holds the current node and the ancestors whose left subtree
+        // it is in, so that a step never climbs the parent links
+        struct walk_t
+        {
+            Position current;
+            std::vector<index_t> stack;
+
+            friend bool operator==(const walk_t & lhs, const walk_t & rhs)
+            {
+                return lhs.current == rhs.current;
+            }
+        };
+
+        using data_type = std::variant<list_t, walk_t, range_t>;
+
+        iterator(const PointSet * set, list_t && points);
+        iterator(const PointSet * set, walk_t && walk);
+        iterator(const PointSet * set, range_t && range);
+
+        // Moves to the next point in order, the exhausted walk becomes equal to end()
+        void find_in_order();
+        // Moves to the next point inside the rect, the exhausted iterator becomes equal to the default one
+        void find_in_range();
+
+        const PointSet * m_set = nullptr;
         data_type m_data;
     };
 
     PointSet() = default;
+    PointSet(const BuildOptions & options);
     PointSet(const std::string & filename);
-    PointSet(const PointSet & other);
-    PointSet(PointSet && other);
+    PointSet(const std::string & filename, const BuildOptions & options);
+    // Copies the pools as they are, a set opened with load() shares the mapping with the copy
+    PointSet(const PointSet & other) = default;
+    PointSet(PointSet && other) noexcept;
 
     ~PointSet() = default;
 
+    // Leaves the set unchanged if the copy throws
+    PointSet & operator=(const PointSet & other);
+    PointSet & operator=(PointSet && other) noexcept;
+
     bool empty() const;
     std::size_t size() const;
     void put(const Point & point);
+    // Puts the whole batch at once, the affected subtrees are rebalanced once at the end
+    void put_range(const std::vector<Point> & points);
+    template <class It>
+    void put_range(It begin, It end);
+    // Erased points are marked and dropped when their subtree is rebuilt.
+    // Both return the number of erased points.
+    std::size_t erase(const Point & point);
+    std::size_t erase(const Rect & rect);
     bool contains(const Point & point) const;
 
+    // Rebuilds the subtrees left by the updates because of BuildOptions::rebuild_limit.
+    // The queries stay correct without it, only slower as the tree goes out of balance.
+    void maintain();
+
+    // Rebuilds the tree balanced and lays the nodes out in van Emde Boas order, so that every
+    // few levels of a descent share a cache line or page. Meant for sets that are queried much
+    // more often than modified, later modifications keep working but append to the layout.
+    // save() writes the nodes in their current order, so a loaded frozen set stays frozen.
+    void freeze();
+
     std::pair<iterator, iterator> range(const Rect & rect) const;
+    // Subtrees lying inside the rect are counted by their size without being visited
+    std::size_t range_count(const Rect & rect) const;
+    // In order of the tree
     iterator begin() const;
     iterator end() const;
 
     std::optional<Point> nearest(const Point &) const;
     std::pair<iterator, iterator> nearest(const Point &, std::size_t) const;
+    // The k nearest among the points at a distance of at most max_dist
+    std::pair<iterator, iterator> nearest(const Point & point, std::size_t k, double max_dist) const;
+    // Points at a distance of at most radius, the subtrees farther than it are skipped
+    std::pair<iterator, iterator> within_radius(const Point & point, double radius) const;
+
+    // Approximate search for bounded latency: a subtree is skipped unless it may hold a point
+    // more than 1 + eps times closer than the current result, and at most max_nodes nodes are
+    // visited. The flag is true when the budget was enough, then every result is within 1 + eps
+    // of the distance of the exact one and eps 0 gives the exact answer.
+    std::pair<std::optional<Point>, bool> nearest_approx(const Point & point, double eps, std::size_t max_nodes) const;
+    // The k points come in order of increasing distance
+    std::pair<std::vector<Point>, bool> nearest_approx(const Point & point, std::size_t k, double eps, std::size_t max_nodes) const;
+
+    // Calls the visitor for every point in the order of the node pool. It sweeps the pool
+    // linearly and is the cheapest full scan, a frozen set is swept in van Emde Boas order.
+    template <class F>
+    void for_each(F && visitor) const;
+    // Calls the visitor for every point inside the rect
+    template <class F>
+    void range_for_each(const Rect & rect, F && visitor) const;
+    // Calls the visitor for the k nearest points in order of increasing distance
+    template <class F>
+    void nearest_for_each(const Point & point, std::size_t k, F && visitor) const;
+    // Calls the visitor for every point at a distance of at most radius without collecting them
+    template <class F>
+    void within_radius_for_each(const Point & point, double radius, F && visitor) const;
+
+    // The i-th result answers the i-th query. Queries are processed in Z-order for cache locality
+    // and split between threads, 0 threads means one per hardware thread.
+    void nearest_batch(const std::vector<Point> & queries,
+                       std::vector<std::optional<Point>> & result,
+                       std::size_t threads = 0) const;
+    void range_batch(const std::vector<Rect> & queries,
+                     std::vector<std::vector<Point>> & result,
+                     std::size_t threads = 0) const;
+
+    // Dual-tree joins with the points of other. The trees of both sets are walked together and
+    // the pairs of subtrees whose rects are too far apart are skipped as a whole. The top subtrees
+    // of the set are joined with other in parallel, 0 threads means one per hardware thread.
+    // Every pair holds a point of the set and a point of other, the pairs come in no particular order.
+
+    // Pairs every point of the set with its nearest point of other
+    void nearest_join(const PointSet & other,
+                      std::vector<std::pair<Point, Point>> & result,
+                      std::size_t threads = 1) const;
+    // Pairs of the points at a distance of at most radius
+    void radius_join(const PointSet & other,
+                     double radius,
+                     std::vector<std::pair<Point, Point>> & result,
+                     std::size_t threads = 1) const;
+
+    // Writes the tree in a flat pointer-free binary format. The tree goes to filename + ".tmp"
+    // first and replaces filename once written, so a loaded set may be saved back to its file.
+    void save(const std::string & filename) const;
+    // Maps a file written by save(), queries read the mapped pages directly.
+    // The nodes are copied into memory by the first modification of the set. leaf_size, alpha
+    // and rebuild_limit are restored from the file, the thread options are the default ones.
+    static PointSet load(const std::string & filename);
+
+    // Counters of the calling thread summed over all the sets
+    static QueryStats query_stats();
+    static void reset_query_stats();
+    TreeShape shape() const;
 
     friend std::ostream & operator<<(std::ostream & ostream, const PointSet & point_set);
 
 private:
+    // Traversal of the joins, see 2dtree_join.cpp
+    class Join;
+
+    static QueryStats & thread_stats();
+
+    const Node & get_node(index_t index) const;
+    // Points of the bucket of a leaf, they may be mapped as well as the nodes
+    const Point * get_bucket(const Node & node) const;
+    const Point & get_point(const Position & position) const;
+    std::size_t node_count() const;
+    std::size_t bucket_storage_size() const;
+    // Makes the set own its nodes before a modification
+    void detach();
+
+    // Compares by the axis and then by the other coordinate, so that distinct points
+    // never tie and every subtree is split exactly at its median
     static bool less(const Point & lhs, const Point & rhs, bool check_x);
-    static bool less(const std::shared_ptr<Node> & lhs, const std::shared_ptr<Node> & rhs, bool check_x);
-    static bool balanced(const std::shared_ptr<Node> & root);
+    static bool has_points(const Node & node);
+    bool balanced(index_t root) const;
+    // The subtree is rebuilt when it is not balanced or has too many erased points
+    bool needs_rebuild(index_t root) const;
+
+    // Both reuse the nodes and buckets freed by rebuilds first
+    index_t allocate(const Point & point);
+    index_t allocate_leaf(const Point * begin, const Point * end);
+    // Most of the pool or the bucket storage is freed
+    bool mostly_free() const;
+    void update_rect_by(Node & node, index_t child) const;
+    void update_data(index_t index);
+    // Updates the node and all of its ancestors
+    void update_path(index_t index);
+
+    // Puts the median of every future subtree at its place, the halves are split between threads
+    void arrange(const std::vector<Point>::iterator & begin,
+                 const std::vector<Point>::iterator & end,
+                 bool check_x,
+                 std::size_t threads) const;
+    // Links the nodes of a range prepared by arrange()
+    index_t link(const std::vector<Point>::iterator & begin, const std::vector<Point>::iterator & end);
+    index_t build_tree(const std::vector<Point>::iterator & begin,
+                       const std::vector<Point>::iterator & end,
+                       bool check_x,
+                       std::size_t threads);
+    // Moves the points of the subtree that are not erased to points and frees its nodes and buckets
+    void release(index_t root, std::vector<Point> & points);
+    // Rebuilds the subtree from its points that are not erased
+    index_t rebuild_tree(index_t root, bool check_x);
+    // Builds a subtree from the points released by a rebuild and counts it in the stats
+    index_t rebuild_points(std::vector<Point> & points, bool check_x);
+    // Updates the path from the lowest node up to the root and rebuilds the nearest to the root
+    // node on it that needs it, then repeats above it as the rebuild drops the erased nodes.
+    // The nodes above the rebuild limit are marked as pending. check_x is the axis of the lowest node.
+    void rebuild_path(index_t lowest, bool check_x);
+    // Moves the tree into a new pool
+    void compact();
+    // Compacts once most of the pool is freed and the tree is within the rebuild limit,
+    // otherwise leaves the compaction for maintain()
+    void compact_if_free();
+    std::size_t height(index_t root) const;
+    // Appends the first height levels of the subtree in van Emde Boas order,
+    // the roots of the subtrees below them are appended to frontier
+    void veb_order(index_t root,
+                   std::size_t height,
+                   std::vector<index_t> & order,
+                   std::vector<index_t> & frontier) const;
+    // Hangs the new subtree root where the old one was attached to the parent
+    void replace_subtree(index_t parent, index_t old_root, index_t new_root);
+
+    // Distributes the batch over the subtree without rebalancing, the nodes getting
+    // new descendants are marked as touched. Returns the new root of the subtree.
+    index_t insert_batch(index_t root,
+                         const std::vector<Point>::iterator & begin,
+                         const std::vector<Point>::iterator & end,
+                         bool check_x,
+                         std::vector<bool> & touched);
+    // Marks the points inside the rect as erased, returns the number of them
+    std::size_t erase(index_t root, const Rect & rect, std::vector<bool> & touched);
+    // Rebuilds the topmost nodes that need it among the touched ones, the ones above the limit
+    // are marked as pending instead. Returns true when a node in the subtree is left pending.
+    bool rebalance(index_t root, bool check_x, const std::vector<bool> & touched, std::size_t limit);
+    // Marks the node and its ancestors, so that maintain() finds the node from the root
+    void mark_pending(index_t index);
+
+    index_t get_size(index_t node) const;
+    index_t get_count(index_t node) const;
+
+    // Pushes the node and its left descendants, the leftmost one ends up on top
+    void push_left_path(index_t node, std::vector<index_t> & stack) const;
+
+    // Limits of the nearest searches, the exact ones run without any
+    struct SearchBudget
+    {
+        // Subtrees are visited only when their square distance times shrink is below the current one
+        double shrink = 1;
+        std::size_t nodes = std::numeric_limits<std::size_t>::max();
+        // Points farther than this are not looked for
+        double sqr_max_dist = std::numeric_limits<double>::infinity();
+        // Set once a subtree that had to be visited is skipped because the nodes ran out
+        bool exhausted = false;
+    };
 
-    static std::shared_ptr<Node> build_tree(const std::vector<std::shared_ptr<Node>>::iterator & begin,
-                                            const std::vector<std::shared_ptr<Node>>::iterator & end,
-                                            bool check_x = true);
-    static std::shared_ptr<Node> rebuild_tree(std::shared_ptr<Node> & root, bool check_x);
+    // Depth-first nearest search visiting the nearer child first
+    const Point * nearest(const Point & point, SearchBudget & budget) const;
+    // Branch-and-bound k nearest search, heap is a max-heap by distance to the point
+    void nearest(index_t root,
+                 const Point & point,
+                 std::size_t k,
+                 bool check_x,
+                 std::vector<const Point *> & heap,
+                 SearchBudget & budget) const;
+    std::vector<const Point *> k_nearest(const Point & point,
+                                         std::size_t k,
+                                         double sqr_max_dist = std::numeric_limits<double>::infinity()) const;
+
+    constexpr static const double max_erased_fraction = 0.5;
+
+    BuildOptions m_options;
+
+    std::vector<Node> m_nodes;
+    // Buckets of leaf_size points each
+    std::vector<Point> m_points;
+    index_t m_root = nil;
+
+    std::vector<index_t> m_free_nodes;
+    std::vector<index_t> m_free_buckets;
+    // Nodes on the paths to the subtrees waiting for maintain(), indexed by node
+    std::vector<bool> m_pending;
+
+    // Nodes of a set opened with load(), m_nodes and m_points are not used while they are set
+    std::shared_ptr<const detail::MappedFile> m_mapping;
+    const Node * m_mapped_nodes = nullptr;
+    std::size_t m_mapped_count = 0;
+    const Point * m_mapped_points = nullptr;
+    std::size_t m_mapped_point_count = 0;
+};
 
-    static std::size_t get_size(const std::shared_ptr<Node> & node);
+inline const PointSet::Node & PointSet::get_node(const index_t index) const
+{
+    return (m_mapped_nodes != nullptr) ? m_mapped_nodes[index] : m_nodes[index];
+}
 
-    // Returns pointer to the nearest NodePtr to the root that is not balanced
-    static std::pair<std::shared_ptr<Node> *, bool> insert(std::shared_ptr<Node> & root,
-                                                           const Point & point,
-                                                           bool check_x = true);
+inline const Point * PointSet::get_bucket(const Node & node) const
+{
+    return ((m_mapped_nodes != nullptr) ? m_mapped_points : m_points.data()) + node.bucket;
+}
 
-    static NodePtr begin(std::shared_ptr<Node> root);
-    static NodePtr next(const NodePtr & node);
+inline const Point & PointSet::get_point(const Position & position) const
+{
+    const Node & node = get_node(position.node);
+    return (node.bucket != nil) ? get_bucket(node)[position.offset] : node.point;
+}
 
-    static void set_parents(const std::shared_ptr<Node> & node);
+inline std::size_t PointSet::node_count() const
+{
+    return (m_mapped_nodes != nullptr) ? m_mapped_count : m_nodes.size();
+}
 
-    static void to_vector(const std::shared_ptr<Node> & root, std::vector<NodePtr> & result);
-    static void move_to_vector(std::shared_ptr<Node> & root, std::vector<std::shared_ptr<Node>> & result);
+inline std::size_t PointSet::bucket_storage_size() const
+{
+    return (m_mapped_nodes != nullptr) ? m_mapped_point_count : m_points.size();
+}
 
-    static void range(const std::shared_ptr<Node> & root, const Rect & rect, std::vector<NodePtr> & result);
-    static void nearest(const std::shared_ptr<Node> & root,
-                        const Point & point,
-                        double & current_min,
-                        NodePtr & current_ans);
+inline bool PointSet::less(const Point & lhs, const Point & rhs, const bool check_x) // NOLINT
+{
+    return check_x ? detail::split_less<2, 0>(lhs, rhs) : detail::split_less<2, 1>(lhs, rhs);
+}
 
-    constexpr static const double alpha = 0.65;
+inline bool PointSet::has_points(const Node & node)
+{
+    return (node.bucket != nil) ? node.count != 0 : !node.erased;
+}
 
-    std::shared_ptr<Node> m_root;
-};
+inline PointSet::index_t PointSet::get_size(const index_t node) const
+{
+    return node != nil ? get_node(node).size : 0;
+}
+
+inline PointSet::index_t PointSet::get_count(const index_t node) const
+{
+    return node != nil ? get_node(node).count : 0;
+}
+
+inline bool PointSet::empty() const
+{
+    return size() == 0;
+}
+
+inline std::size_t PointSet::size() const
+{
+    return get_size(m_root);
+}
+
+template <class It>
+void PointSet::put_range(It begin, It end)
+{
+    put_range(std::vector<Point>(begin, end));
+}
+
+template <class F>
+void PointSet::for_each(F && visitor) const
+{
+    // the nodes freed by rebuilds are marked erased and hold no bucket
+    for (std::size_t i = 0, count = node_count(); i < count; ++i) {
+        const Node & node = get_node(static_cast<index_t>(i));
+        if (node.bucket != nil) {
+            const Point * bucket = get_bucket(node);
+            for (index_t j = 0; j < node.count; ++j) {
+                if (!detail::visit(visitor, bucket[j])) {
+                    return;
+                }
+            }
+        }
+        else if (!node.erased && !detail::visit(visitor, node.point)) {
+            return;
+        }
+    }
+}
+
+template <class F>
+void PointSet::range_for_each(const Rect & rect, F && visitor) const
+{
+    if (m_root == nil || !get_node(m_root).rect.intersects(rect)) {
+        return;
+    }
+    std::vector<index_t> stack;
+    stack.reserve(64);
+    stack.push_back(m_root);
+    while (!stack.empty()) {
+        const Node & node = get_node(stack.back());
+        stack.pop_back();
+        KDTREE_COUNT(nodes_visited, 1);
+        if (node.bucket != nil) {
+            const Point * bucket = get_bucket(node);
+            for (std::size_t i = detail::find_in_rect(bucket, 0, node.count, rect); i < node.count;
+                 i = detail::find_in_rect(bucket, i + 1, node.count, rect)) {
+                if (!detail::visit(visitor, bucket[i])) {
+                    return;
+                }
+            }
+        }
+        else if (!node.erased && rect.contains(node.point) && !detail::visit(visitor, node.point)) {
+            return;
+        }
+        for (const index_t child : {node.right, node.left}) {
+            if (child != nil && get_node(child).rect.intersects(rect)) {
+                stack.push_back(child);
+            }
+            else if (child != nil) {
+                KDTREE_COUNT(subtrees_pruned, 1);
+            }
+        }
+    }
+}
+
+template <class F>
+void PointSet::nearest_for_each(const Point & point, const std::size_t k, F && visitor) const
+{
+    std::vector<const Point *> heap = k_nearest(point, k);
+    std::sort_heap(heap.begin(), heap.end(), [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    });
+    for (const Point * candidate : heap) {
+        if (!detail::visit(visitor, *candidate)) {
+            return;
+        }
+    }
+}
+
+template <class F>
+void PointSet::within_radius_for_each(const Point & point, const double radius, F && visitor) const
+{
+    if (m_root == nil || !(radius >= 0)) {
+        return;
+    }
+    const double sqr_radius = radius * radius;
+    // the buckets are scanned for the points strictly closer than the bound
+    const double bound = std::nextafter(sqr_radius, std::numeric_limits<double>::infinity());
+    std::vector<index_t> stack;
+    stack.reserve(64);
+    stack.push_back(m_root);
+    while (!stack.empty()) {
+        const Node & node = get_node(stack.back());
+        stack.pop_back();
+        if (node.rect.sqr_distance(point) > sqr_radius) {
+            KDTREE_COUNT(subtrees_pruned, 1);
+            continue;
+        }
+        KDTREE_COUNT(nodes_visited, 1);
+        if (node.bucket != nil) {
+            KDTREE_COUNT(distance_evaluations, node.count);
+            const Point * bucket = get_bucket(node);
+            for (std::size_t i = detail::find_closer(bucket, 0, node.count, point, bound); i < node.count;
+                 i = detail::find_closer(bucket, i + 1, node.count, point, bound)) {
+                if (!detail::visit(visitor, bucket[i])) {
+                    return;
+                }
+            }
+            continue;
+        }
+        KDTREE_COUNT(distance_evaluations, 1);
+        if (!node.erased && point.sqr_distance(node.point) <= sqr_radius && !detail::visit(visitor, node.point)) {
+            return;
+        }
+        for (const index_t child : {node.right, node.left}) {
+            if (child != nil) {
+                stack.push_back(child);
+            }
+        }
+    }
+}
 
 inline bool operator==(const kdtree::PointSet::iterator & lhs, const kdtree::PointSet::iterator & rhs)
 {
@@ -290,4 +1003,306 @@ inline std::ostream & operator<<(std::ostream & ostream, const kdtree::PointSet
     return ostream;
 }
 
+// Readers work with immutable snapshots and never wait for writers. Writers are serialised,
+// each modification copies the whole current set and publishes the copy. That is O(N) time
+// and memory per call however few points it changes, as the nodes of a PointSet live in one
+// pool that snapshots can not share, so points should be put and erased in batches.
+// maintain() rebuilds its copy outside of the write lock and does not block the writers.
+class ConcurrentPointSet
+{
+    using Update = std::function<void(PointSet &)>;
+
+public:
+    ConcurrentPointSet();
+    ConcurrentPointSet(PointSet && point_set);
+
+    // The snapshot does not change while it is held, iterators into it stay valid too
+    std::shared_ptr<const PointSet> snapshot() const;
+
+    void put(const Point & point);
+    void put(const std::vector<Point> & points);
+    std::size_t erase(const Point & point);
+    std::size_t erase(const Rect & rect);
+    // Runs PointSet::maintain() on a copy while the readers keep the current snapshot and the
+    // writers keep modifying it, then replays their modifications on the copy and publishes it.
+    // A modify() made meanwhile can not be replayed, the rebuilds are then left for the next
+    // call. It may be called periodically from a thread of its own.
+    void maintain();
+
+    // Applies modifier to a private copy of the current set and publishes the result
+    template <class F>
+    void modify(F && modifier);
+
+private:
+    // Applies update as modify() does and logs it for a running maintain(),
+    // returns the number of points it erased
+    std::size_t apply(Update && update);
+
+    // Serialises maintain() calls, which do not hold m_write_mutex while they rebuild
+    std::mutex m_maintain_mutex;
+    std::mutex m_write_mutex;
+    // Accessed only through std::atomic_load and std::atomic_store
+    std::shared_ptr<const PointSet> m_current;
+    // The updates published since a running maintain() took its copy, guarded by m_write_mutex
+    bool m_logging = false;
+    bool m_replayable = true;
+    std::vector<Update> m_log;
+};
+
+template <class F>
+void ConcurrentPointSet::modify(F && modifier)
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    auto next = std::make_shared<PointSet>(*std::atomic_load(&m_current));
+    modifier(*next);
+    std::atomic_store(&m_current, std::shared_ptr<const PointSet>(std::move(next)));
+    m_replayable = m_replayable && !m_logging;
+}
+
 } // namespace kdtree
+
+namespace zorder {
+
+// Static index without per-node links: the points are sorted by their Z-order code in one
+// array, and a directory keeps the bounding rect of every block of block_size of them.
+// Queries binary-search the codes for the Z-intervals of the rect and skip the blocks outside
+// of it. Modifications move the tail of the array or rebuild the whole index, so the set is
+// meant to be filled once with the constructor or put_range().
+class PointSet
+{
+    constexpr static const std::size_t block_size = 64;
+
+    // Query rect, the rect widened by EPS and the codes of the corners of the latter, the code of
+    // every point inside the rect lies between them. The window of a rect missing the bounds of
+    // the set is empty.
+    struct Window
+    {
+        Rect rect;
+        Rect area;
+        std::uint64_t zmin = 0;
+        std::uint64_t zmax = 0;
+        bool empty = false;
+    };
+
+public:
+    class iterator
+    {
+    public:
+        using difference_type = std::ptrdiff_t;
+        using value_type = Point;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+        using iterator_category = std::forward_iterator_tag;
+
+        iterator() = default;
+
+        reference operator*() const;
+        pointer operator->() const;
+        iterator & operator++();
+        iterator operator++(int);
+
+        friend bool operator==(const iterator & lhs, const iterator & rhs);
+        friend bool operator!=(const iterator & lhs, const iterator & rhs);
+
+        friend class PointSet;
+
+    private:
+        // Walks the blocks that may hold points of the rect, index is the current point
+        struct range_t
+        {
+            Window window;
+            std::size_t index;
+
+            friend bool operator==(const range_t & lhs, const range_t & rhs)
+            {
+                return lhs.index == rhs.index;
+            }
+        };
+
+        using data_type = std::variant<std::vector<pointer>, pointer, range_t>;
+
+        iterator(std::vector<pointer> && points);
+        iterator(pointer point);
+        iterator(const PointSet * set, range_t && range);
+
+        // Skips the points out of the rect, the exhausted iterator becomes equal to the default one
+        void find_in_range();
+
+        const PointSet * m_set = nullptr;
+        data_type m_data;
+    };
+
+    PointSet() = default;
+    PointSet(const std::string & filename);
+
+    bool empty() const;
+    std::size_t size() const;
+    // Moves the points after the new one, a point out of the bounds of the set rebuilds the index
+    void put(const Point & point);
+    // Sorts the batch together with the points of the set
+    void put_range(const std::vector<Point> & points);
+    std::size_t erase(const Point & point);
+    std::size_t erase(const Rect & rect);
+    bool contains(const Point & point) const;
+
+    // second iterator points to an element out of range
+    std::pair<iterator, iterator> range(const Rect & rect) const;
+    std::size_t range_count(const Rect & rect) const;
+    // In Z-order
+    iterator begin() const;
+    iterator end() const;
+
+    std::optional<Point> nearest(const Point & point) const;
+    std::pair<iterator, iterator> nearest(const Point & point, std::size_t k) const;
+    // The k nearest among the points at a distance of at most max_dist
+    std::pair<iterator, iterator> nearest(const Point & point, std::size_t k, double max_dist) const;
+    // Points at a distance of at most radius
+    std::pair<iterator, iterator> within_radius(const Point & point, double radius) const;
+
+    // Calls the visitor for every point inside the rect
+    template <class F>
+    void range_for_each(const Rect & rect, F && visitor) const;
+    // Calls the visitor for the k nearest points in order of increasing distance
+    template <class F>
+    void nearest_for_each(const Point & point, std::size_t k, F && visitor) const;
+    // Calls the visitor for every point at a distance of at most radius
+    template <class F>
+    void within_radius_for_each(const Point & point, double radius, F && visitor) const;
+
+    friend std::ostream & operator<<(std::ostream & ostream, const PointSet & point_set);
+
+private:
+    std::size_t block_count() const;
+    std::size_t block_end(std::size_t block) const;
+
+    Window window(const Rect & rect) const;
+    // First block starting from the given one that may hold a point of the window,
+    // block_count() if there is none. Blocks missing the window are skipped by a binary
+    // search for the next code inside it.
+    std::size_t find_block(const Window & window, std::size_t block) const;
+
+    // Index of the point found among the points with its code, size() if there is none
+    std::size_t find(const Point & point) const;
+    // Sorts the points by their codes within the new bounds and rebuilds the directory
+    void build();
+    // Recomputes the rects of the blocks starting from the given one
+    void update_blocks(std::size_t first);
+    void erase_at(std::size_t index);
+
+    // Max-heap by distance to the point. The blocks around the code of the point give the
+    // first k candidates, then the window of the distance to the k-th one is searched.
+    std::vector<const Point *> k_nearest(const Point & point,
+                                         std::size_t k,
+                                         double sqr_max_dist = std::numeric_limits<double>::infinity()) const;
+
+    std::vector<Point> m_points;
+    std::vector<std::uint64_t> m_codes;
+    std::vector<Rect> m_blocks;
+    // Codes are quantised within these bounds, they contain every point but may be wider
+    Rect m_bounds{Point(0, 0), Point(0, 0)};
+};
+
+inline bool PointSet::empty() const
+{
+    return m_points.empty();
+}
+
+inline std::size_t PointSet::size() const
+{
+    return m_points.size();
+}
+
+inline std::size_t PointSet::block_count() const
+{
+    return m_blocks.size();
+}
+
+inline std::size_t PointSet::block_end(const std::size_t block) const
+{
+    return std::min((block + 1) * block_size, m_points.size());
+}
+
+template <class F>
+void PointSet::range_for_each(const Rect & rect, F && visitor) const
+{
+    const Window query = window(rect);
+    if (query.empty) {
+        return;
+    }
+    for (std::size_t block = find_block(query, 0); block < block_count(); block = find_block(query, block + 1)) {
+        const std::size_t end = block_end(block);
+        for (std::size_t i = detail::find_in_rect(m_points.data(), block * block_size, end, rect); i < end;
+             i = detail::find_in_rect(m_points.data(), i + 1, end, rect)) {
+            if (!detail::visit(visitor, m_points[i])) {
+                return;
+            }
+        }
+    }
+}
+
+template <class F>
+void PointSet::nearest_for_each(const Point & point, const std::size_t k, F && visitor) const
+{
+    std::vector<const Point *> heap = k_nearest(point, k);
+    std::sort_heap(heap.begin(), heap.end(), [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    });
+    for (const Point * candidate : heap) {
+        if (!detail::visit(visitor, *candidate)) {
+            return;
+        }
+    }
+}
+
+template <class F>
+void PointSet::within_radius_for_each(const Point & point, const double radius, F && visitor) const
+{
+    if (!(radius >= 0)) {
+        return;
+    }
+    const double sqr_radius = radius * radius;
+    // the blocks are scanned for the points strictly closer than the bound
+    const double bound = std::nextafter(sqr_radius, std::numeric_limits<double>::infinity());
+    const Window query = window(Rect(Point(point.x() - radius, point.y() - radius), Point(point.x() + radius, point.y() + radius)));
+    if (query.empty) {
+        return;
+    }
+    for (std::size_t block = find_block(query, 0); block < block_count(); block = find_block(query, block + 1)) {
+        if (m_blocks[block].sqr_distance(point) > sqr_radius) {
+            continue;
+        }
+        const std::size_t end = block_end(block);
+        for (std::size_t i = detail::find_closer(m_points.data(), block * block_size, end, point, bound); i < end;
+             i = detail::find_closer(m_points.data(), i + 1, end, point, bound)) {
+            if (!detail::visit(visitor, m_points[i])) {
+                return;
+            }
+        }
+    }
+}
+
+inline bool operator==(const zorder::PointSet::iterator & lhs, const zorder::PointSet::iterator & rhs)
+{
+    return lhs.m_data == rhs.m_data;
+}
+
+inline bool operator!=(const zorder::PointSet::iterator & lhs, const zorder::PointSet::iterator & rhs)
+{
+    return !(lhs == rhs);
+}
+
+inline std::ostream & operator<<(std::ostream & ostream, const zorder::PointSet & point_set)
+{
+    ostream << "PointSet(";
+    auto begin = point_set.begin();
+    for (auto it = begin, end = point_set.end(); it != end; ++it) {
+        if (it != begin) {
+            ostream << ", ";
+        }
+        ostream << *it;
+    }
+    ostream << ")";
+    return ostream;
+}
+
+} // namespace zorder
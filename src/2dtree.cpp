@@ -1,8 +1,14 @@
+#include "parallel.h"
+#include "point_reader.h"
 #include "primitives.h"
 
 #include <algorithm>
 #include <cmath>
-#include <fstream>
+#include <future>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
 #include <utility>
 
 Point::Point(double x, double y)
@@ -11,24 +17,9 @@ Point::Point(double x, double y)
 {
 }
 
-double Point::x() const
-{
-    return m_x;
-}
-
-double Point::y() const
-{
-    return m_y;
-}
-
-double Point::sqr(double x)
-{
-    return x * x;
-}
-
 double Point::distance(const Point & other) const
 {
-    return std::sqrt(sqr(m_x - other.m_x) + sqr(m_y - other.m_y));
+    return std::sqrt(sqr_distance(other));
 }
 
 bool Point::in_quad(const Point & other, const Quadrant quad) const
@@ -88,84 +79,70 @@ Rect::Rect(const Point & left_bottom, const Point & right_top)
 {
 }
 
-double Rect::xmin() const
+double Rect::distance(const Point & point) const
 {
-    return m_left_bottom.x();
+    return std::sqrt(sqr_distance(point));
 }
 
-double Rect::ymin() const
+bool Rect::contains(const Rect & other) const
 {
-    return m_left_bottom.y();
+    return contains(other.m_left_bottom) && contains(other.m_right_top);
 }
 
-double Rect::xmax() const
+rbtree::PointSet::iterator::iterator(std::vector<pointer> && points)
+    : m_data(std::forward<std::vector<pointer>>(points))
 {
-    return m_right_top.x();
 }
 
-double Rect::ymax() const
+rbtree::PointSet::iterator::iterator(std::set<value_type>::iterator && it)
+    : m_data(std::forward<std::set<value_type>::iterator>(it))
 {
-    return m_right_top.y();
 }
 
-bool Rect::contains(const Point & point) const
+rbtree::PointSet::iterator::iterator(range_t && range)
+    : m_data(std::forward<range_t>(range))
 {
-    return m_left_bottom.in_quad(point, Point::Quadrant::First) &&
-            m_right_top.in_quad(point, Point::Quadrant::Third);
+    find_in_range();
 }
 
-double Rect::distance(const Point & point) const
+void rbtree::PointSet::iterator::find_in_range()
 {
-    if (contains(point)) {
-        return 0;
+    auto & range = std::get<range_t>(m_data);
+    while (range.current != range.end && !range.rect.contains(*range.current)) {
+        ++range.current;
     }
-    if (m_right_top.in_quad(point, Point::Quadrant::First)) {
-        return m_right_top.distance(point);
+    if (range.current == range.end) {
+        m_data = data_type();
     }
-    if (m_left_bottom.in_quad(point, Point::Quadrant::Third)) {
-        return m_left_bottom.distance(point);
-    }
-    if (m_right_top.in_quad(point, Point::Quadrant::Fourth)) {
-        return (point.y() > ymin()) ? (point.x() - xmax()) : point.distance({xmax(), ymin()});
-    }
-    if (m_left_bottom.in_quad(point, Point::Quadrant::Second)) {
-        return (point.y() > ymin()) ? (xmin() - point.x()) : point.distance({xmin(), ymax()});
-    }
-    return (point.y() > ymax()) ? (point.y() - ymax()) : (ymin() - point.y());
-}
-
-bool Rect::intersects(const Rect & other) const
-{
-    return !(other.ymin() > ymax() || other.ymax() < ymin() || other.xmin() > xmax() || other.xmax() < xmin());
-}
-
-rbtree::PointSet::iterator::iterator(std::vector<pointer> && points)
-    : m_data(std::forward<std::vector<pointer>>(points))
-{
-}
-
-rbtree::PointSet::iterator::iterator(std::set<value_type>::iterator && it)
-    : m_data(std::forward<std::set<value_type>::iterator>(it))
-{
 }
 
 rbtree::PointSet::iterator::reference rbtree::PointSet::iterator::operator*() const
 {
-    return (m_data.index()) ? *std::get<1>(m_data) : *std::get<0>(m_data).back();
+    return *operator->();
 }
 
 rbtree::PointSet::iterator::pointer rbtree::PointSet::iterator::operator->() const
 {
-    return (m_data.index()) ? &*std::get<1>(m_data) : std::get<0>(m_data).back();
+    switch (m_data.index()) {
+    case 0: return std::get<0>(m_data).back();
+    case 1: return &*std::get<1>(m_data);
+    default: return &*std::get<2>(m_data).current;
+    }
 }
 
 rbtree::PointSet::iterator & rbtree::PointSet::iterator::operator++()
 {
-    if (m_data.index() == 0) {
+    switch (m_data.index()) {
+    case 0:
         std::get<0>(m_data).pop_back();
-    }
-    else {
+        break;
+    case 1:
         ++std::get<1>(m_data);
+        break;
+    default:
+        ++std::get<2>(m_data).current;
+        find_in_range();
+        break;
     }
     return *this;
 }
@@ -179,26 +156,38 @@ rbtree::PointSet::iterator rbtree::PointSet::iterator::operator++(int)
 
 rbtree::PointSet::PointSet(const std::string & filename)
 {
-    std::ifstream file(filename);
-    for (double x, y; file >> x;) {
-        file >> y;
-        m_set.emplace(x, y);
-    }
+    const std::vector<Point> points = detail::read_points(filename);
+    m_set.insert(points.begin(), points.end());
 }
 
-bool rbtree::PointSet::empty() const
+void rbtree::PointSet::put(const Point & p)
 {
-    return m_set.empty();
+    m_set.insert(p);
 }
 
-std::size_t rbtree::PointSet::size() const
+void rbtree::PointSet::put_range(const std::vector<Point> & points)
 {
-    return m_set.size();
+    m_set.insert(points.begin(), points.end());
 }
 
-void rbtree::PointSet::put(const Point & p)
+std::size_t rbtree::PointSet::erase(const Point & p)
 {
-    m_set.insert(p);
+    return m_set.erase(p);
+}
+
+std::size_t rbtree::PointSet::erase(const Rect & rect)
+{
+    std::size_t erased = 0;
+    for (auto [it, end] = slab(rect); it != end;) {
+        if (rect.contains(*it)) {
+            it = m_set.erase(it);
+            ++erased;
+        }
+        else {
+            ++it;
+        }
+    }
+    return erased;
 }
 
 bool rbtree::PointSet::contains(const Point & p) const
@@ -216,25 +205,35 @@ rbtree::PointSet::iterator rbtree::PointSet::end() const
     return iterator(m_set.end());
 }
 
-std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointSet::range(const Rect & rect) const
+std::pair<std::set<Point>::iterator, std::set<Point>::iterator> rbtree::PointSet::slab(const Rect & rect) const
 {
-    std::vector<const Point *> result;
-    for (const Point & point : m_set) {
-        if (rect.contains(point)) {
-            result.push_back(&point);
-        }
+    // the set orders points closer than EPS by y, so the bounds are widened once more. The margin
+    // vanishes in rounding away from 0, so both bounds are inclusive and take every y at their x.
+    constexpr double margin = 2 * std::numeric_limits<double>::epsilon();
+    constexpr double infinity = std::numeric_limits<double>::infinity();
+    if (!(rect.xmin() - margin <= rect.xmax() + margin)) {
+        return {m_set.end(), m_set.end()};
     }
-    return {iterator(std::move(result)), iterator()};
+    return {m_set.lower_bound(Point(rect.xmin() - margin, -infinity)), m_set.upper_bound(Point(rect.xmax() + margin, infinity))};
+}
+
+std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointSet::range(const Rect & rect) const
+{
+    auto [begin, end] = slab(rect);
+    return {iterator(iterator::range_t{begin, end, rect}), iterator()};
+}
+
+std::size_t rbtree::PointSet::range_count(const Rect & rect) const
+{
+    std::size_t count = 0;
+    range_for_each(rect, [&count](const Point &) { ++count; });
+    return count;
 }
 
 std::optional<Point> rbtree::PointSet::nearest(const Point & point) const
 {
-    auto result = std::min_element(m_set.begin(),
-                                   m_set.end(),
-                                   [&point](const Point & lhs, const Point & rhs) {
-                                       return point.distance(lhs) < point.distance(rhs);
-                                   });
-    return result != m_set.end() ? std::optional<Point>(*result) : std::optional<Point>();
+    const std::vector<const Point *> heap = k_nearest(point, 1);
+    return heap.empty() ? std::optional<Point>() : std::optional<Point>(*heap.front());
 }
 
 std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointSet::nearest(const Point & point, std::size_t k) const
@@ -245,23 +244,74 @@ std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointS
     if (m_set.size() <= k) {
         return {begin(), end()};
     }
-    std::vector<const Point *> heap(k);
-    auto it = m_set.begin();
-    for (std::size_t i = 0; i < k; ++i) {
-        heap[i] = &(*(it++));
+    return {iterator(k_nearest(point, k)), iterator()};
+}
+
+std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointSet::nearest(const Point & point, std::size_t k, double max_dist) const
+{
+    if (k == 0 || !(max_dist >= 0)) {
+        return {iterator(), iterator()};
+    }
+    return {iterator(k_nearest(point, k, max_dist * max_dist)), iterator()};
+}
+
+std::pair<rbtree::PointSet::iterator, rbtree::PointSet::iterator> rbtree::PointSet::within_radius(const Point & point, double radius) const
+{
+    std::vector<const Point *> points;
+    within_radius_for_each(point, radius, [&points](const Point & candidate) {
+        points.push_back(&candidate);
+    });
+    return {iterator(std::move(points)), iterator()};
+}
+
+std::vector<const Point *> rbtree::PointSet::k_nearest(const Point & point, const std::size_t k, const double sqr_max_dist) const
+{
+    std::vector<const Point *> heap;
+    if (k == 0) {
+        return heap;
     }
-    auto less_dist = [&point](const auto & lhs, const auto & rhs) {
-        return point.distance(*lhs) < point.distance(*rhs);
+    heap.reserve(std::min(k, m_set.size()));
+    auto less_dist = [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
     };
-    std::make_heap(heap.begin(), heap.end(), less_dist);
-    for (; it != m_set.end(); ++it) {
-        if (less_dist(it, heap.front())) {
+    // returns false once the candidate and all the points behind it are too far by x
+    auto offer = [&heap, k, &less_dist, &point, sqr_max_dist](const Point & candidate) {
+        const double gap = candidate.x() - point.x();
+        if (gap * gap > sqr_max_dist) {
+            return false;
+        }
+        if (point.sqr_distance(candidate) > sqr_max_dist) {
+            return true;
+        }
+        if (heap.size() < k) {
+            heap.push_back(&candidate);
+            std::push_heap(heap.begin(), heap.end(), less_dist);
+            return true;
+        }
+        if (gap * gap > point.sqr_distance(*heap.front())) {
+            return false;
+        }
+        if (less_dist(&candidate, heap.front())) {
             std::pop_heap(heap.begin(), heap.end(), less_dist);
-            heap.back() = &(*it);
+            heap.back() = &candidate;
             std::push_heap(heap.begin(), heap.end(), less_dist);
         }
+        return true;
+    };
+    auto right = m_set.lower_bound(Point(point.x(), std::numeric_limits<double>::lowest()));
+    auto left = right;
+    bool left_open = left != m_set.begin();
+    bool right_open = right != m_set.end();
+    while (left_open || right_open) {
+        // the side with the smaller x gap goes first
+        if (right_open && (!left_open || right->x() - point.x() <= point.x() - std::prev(left)->x())) {
+            right_open = offer(*right) && ++right != m_set.end();
+        }
+        else {
+            left_open = offer(*std::prev(left)) && --left != m_set.begin();
+        }
     }
-    return {iterator(std::move(heap)), iterator()};
+    return heap;
 }
 
 kdtree::PointSet::Node::Node(const Point & point)
@@ -270,69 +320,235 @@ kdtree::PointSet::Node::Node(const Point & point)
 {
 }
 
-kdtree::PointSet::Node::Node(const kdtree::PointSet::Node & node)
-    : point(node.point)
-    , rect(node.rect)
-    , left((node.left) ? std::make_shared<Node>(*node.left) : nullptr)
-    , right((node.right) ? std::make_shared<Node>(*node.right) : nullptr)
+void kdtree::PointSet::detach()
 {
+    if (m_mapped_nodes == nullptr) {
+        return;
+    }
+    m_nodes.assign(m_mapped_nodes, m_mapped_nodes + m_mapped_count);
+    m_points.assign(m_mapped_points, m_mapped_points + m_mapped_point_count);
+    m_mapping.reset();
+    m_mapped_nodes = nullptr;
+    m_mapped_count = 0;
+    m_mapped_points = nullptr;
+    m_mapped_point_count = 0;
+}
+
+kdtree::PointSet::index_t kdtree::PointSet::allocate(const Point & point)
+{
+    if (!m_free_nodes.empty()) {
+        const index_t index = m_free_nodes.back();
+        m_free_nodes.pop_back();
+        m_nodes[index] = Node(point);
+        return index;
+    }
+    if (m_nodes.size() >= nil) {
+        throw std::length_error("kdtree::PointSet: too many points");
+    }
+    m_nodes.emplace_back(point);
+    return static_cast<index_t>(m_nodes.size() - 1);
 }
 
-void kdtree::PointSet::Node::update_rect_by(const std::shared_ptr<Node> & node)
+kdtree::PointSet::index_t kdtree::PointSet::allocate_leaf(const Point * begin, const Point * end)
 {
-    if (!node) {
-        return;
+    const index_t index = allocate(*begin);
+    index_t bucket = nil;
+    if (!m_free_buckets.empty()) {
+        bucket = m_free_buckets.back();
+        m_free_buckets.pop_back();
+    }
+    else {
+        if (m_points.size() + m_options.leaf_size >= nil) {
+            throw std::length_error("kdtree::PointSet: too many points");
+        }
+        bucket = static_cast<index_t>(m_points.size());
+        m_points.insert(m_points.end(), m_options.leaf_size, *begin);
     }
-    rect = Rect({std::min(rect.xmin(), node->rect.xmin()),
-                 std::min(rect.ymin(), node->rect.ymin())},
-                {std::max(rect.xmax(), node->rect.xmax()),
-                 std::max(rect.ymax(), node->rect.ymax())});
+    std::copy(begin, end, m_points.begin() + bucket);
+    Node & node = m_nodes[index];
+    node.bucket = bucket;
+    node.count = static_cast<index_t>(end - begin);
+    update_data(index);
+    return index;
 }
 
-std::size_t kdtree::PointSet::get_size(const std::shared_ptr<Node> & node)
+bool kdtree::PointSet::mostly_free() const
 {
-    return node ? node->size : 0;
+    return 2 * m_free_nodes.size() > m_nodes.size() + 64 ||
+            2 * m_free_buckets.size() * m_options.leaf_size > m_points.size() + 64;
 }
 
-void kdtree::PointSet::Node::update_data()
+void kdtree::PointSet::update_rect_by(Node & node, const index_t child) const
 {
-    size = 1 + get_size(left) + get_size(right);
-    rect = Rect(point, point);
-    if (!left && !right) {
+    if (child == nil) {
         return;
     }
-    update_rect_by(left);
-    update_rect_by(right);
+    const Rect & rect = get_node(child).rect;
+    node.rect = Rect({std::min(node.rect.xmin(), rect.xmin()),
+                      std::min(node.rect.ymin(), rect.ymin())},
+                     {std::max(node.rect.xmax(), rect.xmax()),
+                      std::max(node.rect.ymax(), rect.ymax())});
+}
+
+void kdtree::PointSet::update_data(const index_t index)
+{
+    Node & node = m_nodes[index];
+    if (node.bucket != nil) {
+        // buckets are kept packed, so all of their points are alive
+        node.size = node.count;
+        if (node.count == 0) {
+            return;
+        }
+        const Point * bucket = get_bucket(node);
+        double xmin = bucket[0].x();
+        double ymin = bucket[0].y();
+        double xmax = xmin;
+        double ymax = ymin;
+        for (index_t i = 1; i < node.count; ++i) {
+            xmin = std::min(xmin, bucket[i].x());
+            ymin = std::min(ymin, bucket[i].y());
+            xmax = std::max(xmax, bucket[i].x());
+            ymax = std::max(ymax, bucket[i].y());
+        }
+        node.rect = Rect({xmin, ymin}, {xmax, ymax});
+        return;
+    }
+    node.size = (node.erased ? 0 : 1) + get_size(node.left) + get_size(node.right);
+    node.count = 1 + get_count(node.left) + get_count(node.right);
+    node.rect = Rect(node.point, node.point);
+    bool has_rect = !node.erased;
+    for (const index_t child : {node.left, node.right}) {
+        if (get_size(child) == 0) {
+            continue;
+        }
+        if (has_rect) {
+            update_rect_by(node, child);
+        }
+        else {
+            node.rect = get_node(child).rect;
+            has_rect = true;
+        }
+    }
+}
+
+void kdtree::PointSet::update_path(index_t index)
+{
+    for (; index != nil; index = m_nodes[index].parent) {
+        update_data(index);
+    }
+}
+
+kdtree::PointSet::iterator::iterator(const PointSet * set, list_t && points)
+    : m_set(set)
+    , m_data(std::forward<list_t>(points))
+{
+}
+
+kdtree::PointSet::iterator::iterator(const PointSet * set, walk_t && walk)
+    : m_set(set)
+    , m_data(std::forward<walk_t>(walk))
+{
+    find_in_order();
+}
+
+void kdtree::PointSet::iterator::find_in_order()
+{
+    auto & walk = std::get<walk_t>(m_data);
+    if (walk.current.node != nil) {
+        const Node & node = m_set->get_node(walk.current.node);
+        if (node.bucket != nil && walk.current.offset + 1 < node.count) {
+            ++walk.current.offset;
+            return;
+        }
+        walk.stack.pop_back();
+        m_set->push_left_path(node.right, walk.stack);
+    }
+    // nodes without points are passed through to their right subtrees
+    while (!walk.stack.empty() && !has_points(m_set->get_node(walk.stack.back()))) {
+        const index_t right = m_set->get_node(walk.stack.back()).right;
+        walk.stack.pop_back();
+        m_set->push_left_path(right, walk.stack);
+    }
+    walk.current = walk.stack.empty() ? Position() : Position{walk.stack.back(), 0};
 }
 
-kdtree::PointSet::iterator::iterator(list_t && points)
-    : m_data(std::forward<list_t>(points))
+kdtree::PointSet::iterator::iterator(const PointSet * set, range_t && range)
+    : m_set(set)
+    , m_data(std::forward<range_t>(range))
 {
+    find_in_range();
 }
 
-kdtree::PointSet::iterator::iterator(node_t current)
-    : m_data(current)
+void kdtree::PointSet::iterator::find_in_range()
 {
+    auto & range = std::get<range_t>(m_data);
+    auto find_in_bucket = [this, &range](const index_t index, index_t offset) {
+        const Node & node = m_set->get_node(index);
+        offset = static_cast<index_t>(detail::find_in_rect(m_set->get_bucket(node), offset, node.count, range.rect));
+        if (offset == node.count) {
+            return false;
+        }
+        range.current = {index, offset};
+        return true;
+    };
+    // the rest of the bucket holding the current point goes first
+    if (range.current.node != nil && m_set->get_node(range.current.node).bucket != nil &&
+        find_in_bucket(range.current.node, range.current.offset + 1)) {
+        return;
+    }
+    while (!range.stack.empty()) {
+        const index_t index = range.stack.back();
+        range.stack.pop_back();
+        const Node & node = m_set->get_node(index);
+        KDTREE_COUNT(nodes_visited, 1);
+        for (const index_t child : {node.right, node.left}) {
+            if (child != nil && m_set->get_node(child).rect.intersects(range.rect)) {
+                range.stack.push_back(child);
+            }
+            else if (child != nil) {
+                KDTREE_COUNT(subtrees_pruned, 1);
+            }
+        }
+        if (node.bucket != nil) {
+            if (find_in_bucket(index, 0)) {
+                return;
+            }
+        }
+        else if (!node.erased && range.rect.contains(node.point)) {
+            range.current = {index, 0};
+            return;
+        }
+    }
+    m_data = data_type();
 }
 
 kdtree::PointSet::iterator::reference kdtree::PointSet::iterator::operator*() const
 {
-    return (m_data.index()) ? std::get<node_t>(m_data)->point : std::get<list_t>(m_data).back()->point;
+    switch (m_data.index()) {
+    case 0: return *std::get<list_t>(m_data).back();
+    case 1: return m_set->get_point(std::get<walk_t>(m_data).current);
+    default: return m_set->get_point(std::get<range_t>(m_data).current);
+    }
 }
 
 kdtree::PointSet::iterator::pointer kdtree::PointSet::iterator::operator->() const
 {
-    return (m_data.index()) ? &std::get<node_t>(m_data)->point : &std::get<list_t>(m_data).back()->point;
+    return &operator*();
 }
 
 kdtree::PointSet::iterator & kdtree::PointSet::iterator::operator++()
 {
-    if (m_data.index() == 0) {
+    switch (m_data.index()) {
+    case 0:
         std::get<list_t>(m_data).pop_back();
-        return *this;
+        break;
+    case 1:
+        find_in_order();
+        break;
+    default:
+        find_in_range();
+        break;
     }
-    auto & node = std::get<node_t>(m_data);
-    node = next(node);
     return *this;
 }
 
@@ -343,254 +559,875 @@ kdtree::PointSet::iterator kdtree::PointSet::iterator::operator++(int)
     return cpy;
 }
 
-void kdtree::PointSet::set_parents(const std::shared_ptr<Node> & node)
+kdtree::PointSet::PointSet(kdtree::PointSet && other) noexcept
+    : m_options(other.m_options)
+    , m_nodes(std::move(other.m_nodes))
+    , m_points(std::move(other.m_points))
+    , m_root(std::exchange(other.m_root, nil))
+    , m_free_nodes(std::move(other.m_free_nodes))
+    , m_free_buckets(std::move(other.m_free_buckets))
+    , m_pending(std::move(other.m_pending))
+    , m_mapping(std::move(other.m_mapping))
+    , m_mapped_nodes(std::exchange(other.m_mapped_nodes, nullptr))
+    , m_mapped_count(std::exchange(other.m_mapped_count, 0))
+    , m_mapped_points(std::exchange(other.m_mapped_points, nullptr))
+    , m_mapped_point_count(std::exchange(other.m_mapped_point_count, 0))
+{
+}
+
+kdtree::PointSet & kdtree::PointSet::operator=(const PointSet & other)
 {
-    if (node->left) {
-        node->left->parent = node;
-        set_parents(node->left);
+    if (this != &other) {
+        *this = PointSet(other);
     }
-    if (node->right) {
-        node->right->parent = node;
-        set_parents(node->right);
+    return *this;
+}
+
+kdtree::PointSet & kdtree::PointSet::operator=(PointSet && other) noexcept
+{
+    if (this == &other) {
+        return *this;
     }
+    m_options = other.m_options;
+    m_nodes = std::move(other.m_nodes);
+    m_points = std::move(other.m_points);
+    m_root = std::exchange(other.m_root, nil);
+    m_free_nodes = std::move(other.m_free_nodes);
+    m_free_buckets = std::move(other.m_free_buckets);
+    m_pending = std::move(other.m_pending);
+    m_mapping = std::move(other.m_mapping);
+    m_mapped_nodes = std::exchange(other.m_mapped_nodes, nullptr);
+    m_mapped_count = std::exchange(other.m_mapped_count, 0);
+    m_mapped_points = std::exchange(other.m_mapped_points, nullptr);
+    m_mapped_point_count = std::exchange(other.m_mapped_point_count, 0);
+    return *this;
 }
 
-kdtree::PointSet::PointSet(const kdtree::PointSet & other)
-    : m_root((other.m_root) ? std::make_shared<Node>(*other.m_root) : nullptr)
+static_assert(std::is_nothrow_move_constructible_v<kdtree::PointSet> && std::is_nothrow_move_assignable_v<kdtree::PointSet>,
+              "Sets kept in a std::vector have to be moved rather than copied when it grows");
+
+void kdtree::PointSet::arrange(const std::vector<Point>::iterator & begin,
+                               const std::vector<Point>::iterator & end,
+                               bool check_x,
+                               std::size_t threads) const
 {
-    set_parents(m_root);
+    const auto count = static_cast<std::size_t>(end - begin);
+    if (count <= m_options.leaf_size) {
+        return;
+    }
+    const auto median = std::next(begin, static_cast<std::ptrdiff_t>(count / 2));
+    std::nth_element(begin, median, end, [check_x](const Point & lhs, const Point & rhs) {
+        return less(lhs, rhs, check_x);
+    });
+    if (threads > 1 && count >= m_options.parallel_cutoff) {
+        // the halves are disjoint, so the left one may be arranged by another thread
+        auto left_task = std::async(std::launch::async, [&, threads] {
+            arrange(begin, median, !check_x, threads / 2);
+        });
+        arrange(median + 1, end, !check_x, threads - threads / 2);
+        left_task.get();
+    }
+    else {
+        arrange(begin, median, !check_x, 1);
+        arrange(median + 1, end, !check_x, 1);
+    }
 }
 
-kdtree::PointSet::PointSet(kdtree::PointSet && other)
-    : m_root(std::move(other.m_root))
+kdtree::PointSet::index_t kdtree::PointSet::link(const std::vector<Point>::iterator & begin,
+                                                 const std::vector<Point>::iterator & end)
 {
+    if (begin == end) {
+        return nil;
+    }
+    const auto count = static_cast<std::size_t>(end - begin);
+    if (m_options.leaf_size > 1 && count <= m_options.leaf_size) {
+        return allocate_leaf(&*begin, &*begin + count);
+    }
+    const auto median = std::next(begin, static_cast<std::ptrdiff_t>(count / 2));
+    const index_t result = allocate(*median);
+    const index_t left = link(begin, median);
+    const index_t right = link(median + 1, end);
+    Node & node = m_nodes[result];
+    node.left = left;
+    node.right = right;
+    if (left != nil) {
+        m_nodes[left].parent = result;
+    }
+    if (right != nil) {
+        m_nodes[right].parent = result;
+    }
+    update_data(result);
+    return result;
 }
 
-bool kdtree::PointSet::less(const Point & lhs, const Point & rhs, const bool check_x) // NOLINT
+kdtree::PointSet::index_t kdtree::PointSet::build_tree(const std::vector<Point>::iterator & begin,
+                                                       const std::vector<Point>::iterator & end,
+                                                       const bool check_x,
+                                                       const std::size_t threads)
 {
-    return check_x ? (lhs.x() < rhs.x()) : (lhs.y() < rhs.y());
+    // the nodes are allocated by a single thread once the points are in place
+    arrange(begin, end, check_x, threads);
+    return link(begin, end);
 }
 
-bool kdtree::PointSet::less(const std::shared_ptr<Node> & lhs, const std::shared_ptr<Node> & rhs, const bool check_x) // NOLINT
+kdtree::PointSet::PointSet(const BuildOptions & options)
+    : m_options(options)
 {
-    return less(lhs->point, rhs->point, check_x);
+    m_options.threads = detail::thread_count(m_options.threads);
+    m_options.leaf_size = std::max<std::size_t>(m_options.leaf_size, 1);
+    m_options.alpha = std::clamp(m_options.alpha, 0.5, 1.0);
 }
 
-std::shared_ptr<kdtree::PointSet::Node> kdtree::PointSet::build_tree(const std::vector<std::shared_ptr<Node>>::iterator & begin,
-                                                                     const std::vector<std::shared_ptr<Node>>::iterator & end,
-                                                                     bool check_x)
+kdtree::PointSet::PointSet(const std::string & filename)
+    : PointSet(filename, BuildOptions())
 {
-    if (begin == end) {
-        return nullptr;
+}
+
+kdtree::PointSet::PointSet(const std::string & filename, const BuildOptions & options)
+    : PointSet(options)
+{
+    std::vector<Point> points = detail::read_points(filename, m_options.threads);
+    if (points.size() >= nil) {
+        throw std::length_error("kdtree::PointSet: too many points");
     }
-    std::sort(begin,
-              end,
-              [check_x](const std::shared_ptr<Node> & lhs, const std::shared_ptr<Node> & rhs) {
-                  return less(lhs, rhs, check_x);
-              });
-    auto median = begin + (end - begin) / 2;
-    while (median != begin && !less(*(median - 1), *median, check_x)) {
-        --median;
-    }
-    std::shared_ptr<Node> result = std::move(*median);
-    result->left = build_tree(begin, median, !check_x);
-    result->right = build_tree(median + 1, end, !check_x);
-    result->update_data();
-    return result;
+    m_nodes.reserve(points.size() / m_options.leaf_size);
+    m_root = build_tree(points.begin(), points.end(), true, m_options.threads);
 }
 
-kdtree::PointSet::PointSet(const std::string & filename)
+bool kdtree::PointSet::balanced(const index_t root) const
 {
-    std::ifstream file(filename);
-    std::vector<std::shared_ptr<Node>> nodes;
-    std::set<Point> points;
-    for (double x, y; file >> x;) {
-        file >> y;
-        points.emplace(x, y);
+    const Node & node = get_node(root);
+    return get_count(node.left) <= m_options.alpha * node.count &&
+            get_count(node.right) <= m_options.alpha * node.count;
+}
+
+bool kdtree::PointSet::needs_rebuild(const index_t root) const
+{
+    const Node & node = get_node(root);
+    return !balanced(root) || node.count - node.size > max_erased_fraction * node.count;
+}
+
+void kdtree::PointSet::release(const index_t root, std::vector<Point> & points)
+{
+    if (root == nil) {
+        return;
+    }
+    Node & node = m_nodes[root];
+    if (node.bucket != nil) {
+        const Point * bucket = get_bucket(node);
+        points.insert(points.end(), bucket, bucket + node.count);
+        m_free_buckets.push_back(node.bucket);
     }
-    nodes.reserve(points.size());
-    for (auto & p : points) {
-        nodes.push_back(std::make_shared<Node>(p));
+    else if (!node.erased) {
+        points.push_back(node.point);
     }
-    m_root = build_tree(nodes.begin(), nodes.end());
-    set_parents(m_root);
+    release(node.left, points);
+    release(node.right, points);
+    // for_each() sweeps the whole pool and has to pass over the free nodes
+    node.bucket = nil;
+    node.erased = true;
+    if (root < m_pending.size()) {
+        m_pending[root] = false;
+    }
+    m_free_nodes.push_back(root);
 }
 
-bool kdtree::PointSet::empty() const
+kdtree::PointSet::index_t kdtree::PointSet::rebuild_tree(const index_t root, bool check_x)
 {
-    return m_root == nullptr;
+    std::vector<Point> points;
+    points.reserve(get_node(root).size);
+    release(root, points);
+    return rebuild_points(points, check_x);
 }
 
-std::size_t kdtree::PointSet::size() const
+kdtree::PointSet::index_t kdtree::PointSet::rebuild_points(std::vector<Point> & points, const bool check_x)
 {
-    return get_size(m_root);
+#ifdef KDTREE_STATS
+    QueryStats & stats = thread_stats();
+    ++stats.rebuilds;
+    std::size_t bin = 0;
+    for (std::size_t size = points.size(); size > 1 && bin + 1 < stats.rebuild_sizes.size(); size /= 2) {
+        ++bin;
+    }
+    ++stats.rebuild_sizes[bin];
+#endif
+    return build_tree(points.begin(), points.end(), check_x, m_options.threads);
 }
 
-bool kdtree::PointSet::balanced(const std::shared_ptr<Node> & root)
+void kdtree::PointSet::compact()
 {
-    return get_size(root->left) <= alpha * get_size(root) &&
-            get_size(root->right) <= alpha * get_size(root);
+    std::vector<Point> points;
+    points.reserve(size());
+    release(m_root, points);
+    m_nodes = std::vector<Node>();
+    m_nodes.reserve(points.size() / m_options.leaf_size);
+    m_points = std::vector<Point>();
+    m_free_nodes = std::vector<index_t>();
+    m_free_buckets = std::vector<index_t>();
+    m_pending = std::vector<bool>();
+    m_root = rebuild_points(points, true);
 }
 
-void kdtree::PointSet::to_vector(const std::shared_ptr<Node> & root, std::vector<NodePtr> & result)
+void kdtree::PointSet::compact_if_free()
 {
-    if (!root) {
+    if (!mostly_free()) {
         return;
     }
-    to_vector(root->left, result);
-    result.push_back(root.get());
-    to_vector(root->right, result);
+    // the compaction rebuilds the whole tree, so above the limit it waits for maintain() like the
+    // other large rebuilds, the marked root keeps maintain() from returning before it
+    if (get_count(m_root) <= m_options.rebuild_limit) {
+        compact();
+    }
+    else {
+        mark_pending(m_root);
+    }
+}
+
+std::size_t kdtree::PointSet::height(const index_t root) const
+{
+    std::size_t result = 0;
+    if (root == nil) {
+        return result;
+    }
+    std::vector<std::pair<index_t, std::size_t>> stack;
+    stack.reserve(64);
+    stack.emplace_back(root, 1);
+    while (!stack.empty()) {
+        const auto [index, depth] = stack.back();
+        stack.pop_back();
+        result = std::max(result, depth);
+        for (const index_t child : {get_node(index).left, get_node(index).right}) {
+            if (child != nil) {
+                stack.emplace_back(child, depth + 1);
+            }
+        }
+    }
+    return result;
+}
+
+kdtree::QueryStats & kdtree::PointSet::thread_stats()
+{
+    thread_local QueryStats stats;
+    return stats;
+}
+
+kdtree::QueryStats kdtree::PointSet::query_stats()
+{
+    return thread_stats();
+}
+
+void kdtree::PointSet::reset_query_stats()
+{
+    thread_stats() = QueryStats();
+}
+
+kdtree::TreeShape kdtree::PointSet::shape() const
+{
+    TreeShape result;
+    result.height = height(m_root);
+    if (m_root == nil) {
+        return result;
+    }
+    std::vector<index_t> stack;
+    stack.reserve(64);
+    stack.push_back(m_root);
+    while (!stack.empty()) {
+        const Node & node = get_node(stack.back());
+        stack.pop_back();
+        ++result.nodes;
+        if (node.left == nil && node.right == nil) {
+            continue;
+        }
+        const double share = static_cast<double>(std::max(get_count(node.left), get_count(node.right))) / node.count;
+        ++result.imbalance[std::min(static_cast<std::size_t>(share * result.imbalance.size()), result.imbalance.size() - 1)];
+        for (const index_t child : {node.left, node.right}) {
+            if (child != nil) {
+                stack.push_back(child);
+            }
+        }
+    }
+    return result;
 }
 
-void kdtree::PointSet::move_to_vector(std::shared_ptr<Node> & root, std::vector<std::shared_ptr<Node>> & result)
+void kdtree::PointSet::veb_order(const index_t root,
+                                 const std::size_t height,
+                                 std::vector<index_t> & order,
+                                 std::vector<index_t> & frontier) const
 {
-    if (!root) {
+    if (root == nil || height == 0) {
+        return;
+    }
+    if (height == 1) {
+        order.push_back(root);
+        for (const index_t child : {get_node(root).left, get_node(root).right}) {
+            if (child != nil) {
+                frontier.push_back(child);
+            }
+        }
         return;
     }
-    move_to_vector(root->left, result);
-    result.push_back(std::move(root));
-    move_to_vector(result.back()->right, result);
+    // the top half of the levels goes first, then every subtree hanging below it
+    const std::size_t top = height / 2;
+    std::vector<index_t> middle;
+    veb_order(root, top, order, middle);
+    for (const index_t subtree : middle) {
+        veb_order(subtree, height - top, order, frontier);
+    }
 }
 
-std::shared_ptr<kdtree::PointSet::Node> kdtree::PointSet::rebuild_tree(std::shared_ptr<Node> & root, bool check_x)
+void kdtree::PointSet::freeze()
 {
-    std::vector<std::shared_ptr<Node>> nodes;
-    move_to_vector(root, nodes);
-    return build_tree(nodes.begin(), nodes.end(), check_x);
+    if (m_root == nil) {
+        return;
+    }
+    detach();
+    compact();
+    // the compaction drops the tree if no point in it is left
+    if (m_root == nil) {
+        return;
+    }
+    std::vector<index_t> order;
+    order.reserve(m_nodes.size());
+    std::vector<index_t> frontier;
+    veb_order(m_root, height(m_root), order, frontier);
+    std::vector<index_t> position(m_nodes.size());
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        position[order[i]] = static_cast<index_t>(i);
+    }
+    auto relink = [&position](const index_t index) {
+        return (index != nil) ? position[index] : nil;
+    };
+    std::vector<Node> nodes;
+    nodes.reserve(order.size());
+    for (const index_t index : order) {
+        nodes.push_back(m_nodes[index]);
+        Node & node = nodes.back();
+        node.left = relink(node.left);
+        node.right = relink(node.right);
+        node.parent = relink(node.parent);
+    }
+    m_nodes = std::move(nodes);
+    m_root = position[m_root];
 }
 
-std::pair<std::shared_ptr<kdtree::PointSet::Node> *, bool> kdtree::PointSet::insert(std::shared_ptr<Node> & root,
-                                                                                    const Point & point,
-                                                                                    bool check_x)
+void kdtree::PointSet::replace_subtree(const index_t parent, const index_t old_root, const index_t new_root)
 {
-    if (!root) {
-        root = std::make_unique<Node>(point);
-        return {nullptr, false};
+    if (new_root != nil) {
+        m_nodes[new_root].parent = parent;
+    }
+    if (parent == nil) {
+        m_root = new_root;
+    }
+    else if (m_nodes[parent].left == old_root) {
+        m_nodes[parent].left = new_root;
+    }
+    else {
+        m_nodes[parent].right = new_root;
+    }
+}
+
+void kdtree::PointSet::rebuild_path(index_t lowest, bool check_x)
+{
+    bool rebuilt = false;
+    while (lowest != nil) {
+        index_t broken = nil;
+        bool broken_check_x = true;
+        index_t deferred = nil;
+        for (index_t current = lowest; current != nil; current = m_nodes[current].parent, check_x = !check_x) {
+            update_data(current);
+            if (!needs_rebuild(current)) {
+                continue;
+            }
+            // the counts only grow towards the root, so every node above a deferred one is deferred too
+            if (m_nodes[current].count <= m_options.rebuild_limit) {
+                broken = current;
+                broken_check_x = check_x;
+            }
+            else if (deferred == nil) {
+                deferred = current;
+            }
+        }
+        if (deferred != nil) {
+            mark_pending(deferred);
+        }
+        if (broken == nil) {
+            break;
+        }
+        const index_t parent = m_nodes[broken].parent;
+        replace_subtree(parent, broken, rebuild_tree(broken, broken_check_x));
+        rebuilt = true;
+        // erased nodes dropped by the rebuild change the node counts above it and may unbalance them
+        lowest = parent;
+        check_x = !broken_check_x;
     }
-    if (root->point == point) {
-        return {nullptr, false};
+    if (rebuilt) {
+        compact_if_free();
     }
-    auto & to = less(point, root->point, check_x) ? root->left : root->right;
-    auto [broken, prev_check] = insert(to, point, !check_x);
-    root->update_data();
-    to->parent = root;
-    return balanced(root) ? std::make_pair(broken, prev_check) : std::make_pair(&root, check_x);
 }
 
 void kdtree::PointSet::put(const Point & point)
 {
-    auto [broken, check_x] = insert(m_root, point);
-    if (broken != nullptr) {
-        auto parent = (*broken)->parent;
-        *broken = rebuild_tree(*broken, check_x);
-        (*broken)->parent = parent;
-        set_parents(*broken);
+    detach();
+    index_t parent = nil;
+    bool to_left = false;
+    bool check_x = true;
+    for (index_t current = m_root; current != nil; check_x = !check_x) {
+        Node & node = m_nodes[current];
+        if (node.bucket != nil) {
+            Point * bucket = m_points.data() + node.bucket;
+            if (std::find(bucket, bucket + node.count, point) != bucket + node.count) {
+                return;
+            }
+            if (node.count < m_options.leaf_size) {
+                bucket[node.count++] = point;
+                rebuild_path(current, check_x);
+                return;
+            }
+            // the full bucket is split in two
+            std::vector<Point> points;
+            points.reserve(node.count + 1);
+            release(current, points);
+            points.push_back(point);
+            replace_subtree(parent, current, build_tree(points.begin(), points.end(), check_x, 1));
+            rebuild_path(parent, !check_x);
+            return;
+        }
+        if (node.point == point) {
+            if (node.erased) {
+                node.erased = false;
+                update_path(current);
+            }
+            return;
+        }
+        parent = current;
+        to_left = less(point, node.point, check_x);
+        current = to_left ? node.left : node.right;
+    }
+    const index_t created = (m_options.leaf_size > 1) ? allocate_leaf(&point, &point + 1) : allocate(point);
+    m_nodes[created].parent = parent;
+    if (parent == nil) {
+        m_root = created;
+        return;
     }
+    (to_left ? m_nodes[parent].left : m_nodes[parent].right) = created;
+    rebuild_path(parent, !check_x);
 }
 
-bool kdtree::PointSet::contains(const Point & point) const
+std::size_t kdtree::PointSet::erase(const Point & point)
 {
-    std::shared_ptr<Node> current = m_root;
     bool check_x = true;
-    while (current) {
-        if (current->point == point) {
-            return true;
+    for (index_t current = m_root; current != nil; check_x = !check_x) {
+        const Node & node = get_node(current);
+        if (node.bucket != nil) {
+            const Point * bucket = get_bucket(node);
+            const auto offset = static_cast<index_t>(std::find(bucket, bucket + node.count, point) - bucket);
+            if (offset == node.count) {
+                return 0;
+            }
+            detach();
+            // buckets are kept packed, the last point takes the place of the erased one
+            Node & leaf = m_nodes[current];
+            --leaf.count;
+            m_points[leaf.bucket + offset] = m_points[leaf.bucket + leaf.count];
+            rebuild_path(current, check_x);
+            return 1;
         }
-        current = less(point, current->point, check_x) ? current->left : current->right;
-        check_x = !check_x;
+        if (node.point == point) {
+            if (node.erased) {
+                return 0;
+            }
+            detach();
+            m_nodes[current].erased = true;
+            rebuild_path(current, check_x);
+            return 1;
+        }
+        current = less(point, node.point, check_x) ? node.left : node.right;
     }
-    return false;
+    return 0;
+}
+
+std::size_t kdtree::PointSet::erase(const index_t root, const Rect & rect, std::vector<bool> & touched)
+{
+    if (root == nil || !m_nodes[root].rect.intersects(rect)) {
+        return 0;
+    }
+    Node & node = m_nodes[root];
+    std::size_t erased = 0;
+    if (node.bucket != nil) {
+        Point * bucket = m_points.data() + node.bucket;
+        const Point * kept = std::remove_if(bucket, bucket + node.count, [&rect](const Point & point) {
+            return rect.contains(point);
+        });
+        erased = static_cast<std::size_t>(bucket + node.count - kept);
+        node.count = static_cast<index_t>(kept - bucket);
+    }
+    else if (!node.erased && rect.contains(node.point)) {
+        node.erased = true;
+        ++erased;
+    }
+    erased += erase(node.left, rect, touched);
+    erased += erase(node.right, rect, touched);
+    if (erased != 0) {
+        touched[root] = true;
+        update_data(root);
+    }
+    return erased;
+}
+
+std::size_t kdtree::PointSet::erase(const Rect & rect)
+{
+    if (range_count(rect) == 0) {
+        return 0;
+    }
+    detach();
+    std::vector<bool> touched(m_nodes.size(), false);
+    const std::size_t erased = erase(m_root, rect, touched);
+    rebalance(m_root, true, touched, m_options.rebuild_limit);
+    compact_if_free();
+    return erased;
+}
+
+kdtree::PointSet::index_t kdtree::PointSet::insert_batch(const index_t root,
+                                                         const std::vector<Point>::iterator & begin,
+                                                         const std::vector<Point>::iterator & end,
+                                                         const bool check_x,
+                                                         std::vector<bool> & touched)
+{
+    if (begin == end) {
+        return root;
+    }
+    if (root == nil) {
+        return build_tree(begin, end, check_x, m_options.threads);
+    }
+    if (m_nodes[root].bucket != nil) {
+        const Node & leaf = m_nodes[root];
+        const Point * bucket = get_bucket(leaf);
+        const auto fresh = std::remove_if(begin, end, [bucket, &leaf](const Point & point) {
+            return std::find(bucket, bucket + leaf.count, point) != bucket + leaf.count;
+        });
+        const auto added = static_cast<std::size_t>(fresh - begin);
+        if (leaf.count + added <= m_options.leaf_size) {
+            if (added != 0) {
+                std::copy(begin, fresh, m_points.begin() + leaf.bucket + leaf.count);
+                m_nodes[root].count += static_cast<index_t>(added);
+                touched[root] = true;
+                update_data(root);
+            }
+            return root;
+        }
+        // the overflowing bucket is replaced with a balanced subtree
+        std::vector<Point> points(begin, fresh);
+        release(root, points);
+        return build_tree(points.begin(), points.end(), check_x, m_options.threads);
+    }
+    // the points are matched in the same order as in contains(): equal ones are already in the tree
+    const Point split = m_nodes[root].point;
+    const auto rest = std::partition(begin, end, [&split](const Point & point) {
+        return point == split;
+    });
+    const auto middle = std::partition(rest, end, [&split, check_x](const Point & point) {
+        return less(point, split, check_x);
+    });
+    if (rest != begin && m_nodes[root].erased) {
+        m_nodes[root].erased = false;
+        touched[root] = true;
+    }
+    if (rest == end) {
+        if (touched[root]) {
+            update_data(root);
+        }
+        return root;
+    }
+    touched[root] = true;
+    // allocations invalidate references into the pool, so the node is looked up again every time
+    for (const bool to_left : {true, false}) {
+        const index_t child = to_left ? m_nodes[root].left : m_nodes[root].right;
+        const index_t result = to_left ? insert_batch(child, rest, middle, !check_x, touched)
+                                       : insert_batch(child, middle, end, !check_x, touched);
+        if (result != nil) {
+            m_nodes[result].parent = root;
+        }
+        (to_left ? m_nodes[root].left : m_nodes[root].right) = result;
+    }
+    update_data(root);
+    return root;
+}
+
+bool kdtree::PointSet::rebalance(const index_t root,
+                                 const bool check_x,
+                                 const std::vector<bool> & touched,
+                                 const std::size_t limit)
+{
+    if (root == nil || root >= touched.size() || !touched[root]) {
+        return false;
+    }
+    bool pending = false;
+    if (!needs_rebuild(root) || m_nodes[root].count > limit) {
+        pending = rebalance(m_nodes[root].left, !check_x, touched, limit);
+        pending = rebalance(m_nodes[root].right, !check_x, touched, limit) || pending;
+        // rebuilds below drop erased nodes and change the node counts, which may unbalance the node
+        update_data(root);
+    }
+    if (needs_rebuild(root) && m_nodes[root].count <= limit) {
+        const index_t parent = m_nodes[root].parent;
+        replace_subtree(parent, root, rebuild_tree(root, check_x));
+        return false;
+    }
+    pending = pending || needs_rebuild(root);
+    if (pending) {
+        mark_pending(root);
+    }
+    return pending;
 }
 
-void kdtree::PointSet::range(const std::shared_ptr<Node> & root,
-                             const Rect & rect,
-                             std::vector<NodePtr> & result)
+void kdtree::PointSet::mark_pending(index_t index)
 {
-    if (!root || !root->rect.intersects(rect)) {
+    if (m_pending.size() < m_nodes.size()) {
+        m_pending.resize(m_nodes.size(), false);
+    }
+    // freed nodes are unmarked by release(), so a marked node always has its ancestors marked
+    for (; index != nil && !m_pending[index]; index = m_nodes[index].parent) {
+        m_pending[index] = true;
+    }
+}
+
+void kdtree::PointSet::maintain()
+{
+    if (m_pending.empty()) {
         return;
     }
-    if (rect.contains(root->point)) {
-        result.push_back(root.get());
+    std::vector<bool> pending;
+    pending.swap(m_pending);
+    rebalance(m_root, true, pending, std::numeric_limits<std::size_t>::max());
+    if (mostly_free()) {
+        compact();
     }
-    if (root->left && root->left->rect.intersects(rect)) {
-        range(root->left, rect, result);
+}
+
+void kdtree::PointSet::put_range(const std::vector<Point> & points)
+{
+    if (points.empty()) {
+        return;
+    }
+    detach();
+    std::vector<Point> batch(points);
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+    if (m_nodes.size() + batch.size() >= nil) {
+        throw std::length_error("kdtree::PointSet: too many points");
     }
-    if (root->right && root->right->rect.intersects(rect)) {
-        range(root->right, rect, result);
+    m_nodes.reserve(m_nodes.size() + batch.size() / m_options.leaf_size);
+    std::vector<bool> touched(m_nodes.size(), false);
+    m_root = insert_batch(m_root, batch.begin(), batch.end(), true, touched);
+    m_nodes[m_root].parent = nil;
+    rebalance(m_root, true, touched, m_options.rebuild_limit);
+    compact_if_free();
+}
+
+bool kdtree::PointSet::contains(const Point & point) const
+{
+    index_t current = m_root;
+    bool check_x = true;
+    while (current != nil) {
+        const Node & node = get_node(current);
+        if (node.bucket != nil) {
+            const Point * bucket = get_bucket(node);
+            return std::find(bucket, bucket + node.count, point) != bucket + node.count;
+        }
+        if (node.point == point) {
+            return !node.erased;
+        }
+        current = less(point, node.point, check_x) ? node.left : node.right;
+        check_x = !check_x;
     }
+    return false;
 }
 
 std::pair<kdtree::PointSet::iterator, kdtree::PointSet::iterator> kdtree::PointSet::range(const Rect & rect) const
 {
-    std::vector<NodePtr> result;
-    range(m_root, rect, result);
-    return {iterator(std::move(result)), iterator()};
+    iterator::range_t range{rect, Position(), {}};
+    if (m_root != nil && get_node(m_root).rect.intersects(rect)) {
+        range.stack.reserve(64);
+        range.stack.push_back(m_root);
+    }
+    return {iterator(this, std::move(range)), iterator()};
 }
 
-kdtree::PointSet::NodePtr kdtree::PointSet::begin(std::shared_ptr<Node> root)
+std::size_t kdtree::PointSet::range_count(const Rect & rect) const
 {
-    if (!root) {
-        return {};
+    if (m_root == nil || !get_node(m_root).rect.intersects(rect)) {
+        return 0;
     }
-    while (root->left) {
-        root = root->left;
+    std::size_t count = 0;
+    std::vector<index_t> stack;
+    stack.reserve(64);
+    stack.push_back(m_root);
+    while (!stack.empty()) {
+        const Node & node = get_node(stack.back());
+        stack.pop_back();
+        KDTREE_COUNT(nodes_visited, 1);
+        if (rect.contains(node.rect)) {
+            count += node.size;
+            continue;
+        }
+        if (node.bucket != nil) {
+            count += detail::count_in_rect(get_bucket(node), node.count, rect);
+        }
+        else if (!node.erased && rect.contains(node.point)) {
+            ++count;
+        }
+        for (const index_t child : {node.left, node.right}) {
+            if (child != nil && get_node(child).rect.intersects(rect)) {
+                stack.push_back(child);
+            }
+            else if (child != nil) {
+                KDTREE_COUNT(subtrees_pruned, 1);
+            }
+        }
+    }
+    return count;
+}
+
+void kdtree::PointSet::push_left_path(index_t node, std::vector<index_t> & stack) const
+{
+    for (; node != nil; node = get_node(node).left) {
+        stack.push_back(node);
     }
-    return root.get();
 }
 
 kdtree::PointSet::iterator kdtree::PointSet::begin() const
 {
-    return iterator(begin(m_root));
+    iterator::walk_t walk;
+    walk.stack.reserve(64);
+    push_left_path(m_root, walk.stack);
+    return iterator(this, std::move(walk));
 }
 
 kdtree::PointSet::iterator kdtree::PointSet::end() const
 {
-    return iterator(nullptr);
+    return iterator(this, iterator::walk_t());
 }
 
-kdtree::PointSet::NodePtr kdtree::PointSet::next(const NodePtr & node) // NOLINT
+std::optional<Point> kdtree::PointSet::nearest(const Point & point) const
 {
-    if (node->right) {
-        auto ans = node->right;
-        while (ans->left) {
-            ans = ans->left;
-        }
-        return ans.get();
+    SearchBudget budget;
+    const Point * result = nearest(point, budget);
+    return (result != nullptr) ? std::optional<Point>(*result) : std::optional<Point>();
+}
+
+const Point * kdtree::PointSet::nearest(const Point & point, SearchBudget & budget) const
+{
+    struct Entry
+    {
+        index_t node;
+        bool check_x;
+        double sqr_bound;
+    };
+    if (m_root == nil) {
+        return nullptr;
     }
-    auto ans = node;
-    while (!ans->parent.expired()) {
-        auto parent = ans->parent.lock();
-        if (parent->left && parent->left.get() == ans) {
-            ans = parent.get();
-            return ans;
+    std::vector<Entry> stack;
+    stack.reserve(64);
+    stack.push_back({m_root, true, 0});
+    double current_min = std::numeric_limits<double>::max();
+    const Point * result = nullptr;
+    while (!stack.empty()) {
+        const Entry entry = stack.back();
+        stack.pop_back();
+        if (entry.sqr_bound * budget.shrink >= current_min) {
+            KDTREE_COUNT(subtrees_pruned, 1);
+            continue;
+        }
+        if (budget.nodes == 0) {
+            budget.exhausted = true;
+            break;
+        }
+        --budget.nodes;
+        const Node & node = get_node(entry.node);
+        KDTREE_COUNT(nodes_visited, 1);
+        if (node.bucket != nil) {
+            KDTREE_COUNT(distance_evaluations, node.count);
+            const Point * bucket = get_bucket(node);
+            for (std::size_t i = detail::find_closer(bucket, 0, node.count, point, current_min); i < node.count;
+                 i = detail::find_closer(bucket, i + 1, node.count, point, current_min)) {
+                current_min = point.sqr_distance(bucket[i]);
+                result = bucket + i;
+            }
+            continue;
+        }
+        const double dist = point.sqr_distance(node.point);
+        KDTREE_COUNT(distance_evaluations, 1);
+        if (!node.erased && dist < current_min) {
+            current_min = dist;
+            result = &node.point;
+        }
+        const bool go_left = less(point, node.point, entry.check_x);
+        // the far child is pushed first so that the near one is popped first
+        for (const index_t child : {go_left ? node.right : node.left, go_left ? node.left : node.right}) {
+            if (child != nil) {
+                const double bound = get_node(child).rect.sqr_distance(point);
+                if (bound * budget.shrink < current_min) {
+                    stack.push_back({child, !entry.check_x, bound});
+                }
+                else {
+                    KDTREE_COUNT(subtrees_pruned, 1);
+                }
+            }
         }
-        ans = parent.get();
     }
-    return {};
+    return result;
 }
 
-void kdtree::PointSet::nearest(const std::shared_ptr<Node> & root,
+void kdtree::PointSet::nearest(const index_t root,
                                const Point & point,
-                               double & current_min,
-                               NodePtr & current_ans)
+                               const std::size_t k,
+                               const bool check_x,
+                               std::vector<const Point *> & heap,
+                               SearchBudget & budget) const
 {
-    if (!root || root->rect.distance(point) >= current_min) {
+    auto less_dist = [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    };
+    auto offer = [&heap, k, &less_dist](const Point * candidate) {
+        detail::offer_candidate(heap, k, candidate, less_dist);
+    };
+    if (root == nil) {
         return;
     }
-    if (point.distance(root->point) < current_min) {
-        current_min = point.distance(root->point);
-        current_ans = root.get();
+    const Node & node = get_node(root);
+    const double sqr_bound = node.rect.sqr_distance(point);
+    if (sqr_bound > budget.sqr_max_dist ||
+        (heap.size() == k && sqr_bound * budget.shrink > point.sqr_distance(*heap.front()))) {
+        KDTREE_COUNT(subtrees_pruned, 1);
+        return;
     }
-    nearest(root->left, point, current_min, current_ans);
-    nearest(root->right, point, current_min, current_ans);
-}
-
-std::optional<Point> kdtree::PointSet::nearest(const Point & point) const
-{
-    double current_min = std::numeric_limits<double>::max();
-    NodePtr result = nullptr;
-    nearest(m_root, point, current_min, result);
-    return (result != nullptr) ? std::optional<Point>(result->point) : std::optional<Point>();
+    if (budget.nodes == 0) {
+        budget.exhausted = true;
+        return;
+    }
+    --budget.nodes;
+    KDTREE_COUNT(nodes_visited, 1);
+    if (node.bucket != nil) {
+        KDTREE_COUNT(distance_evaluations, node.count);
+        const Point * bucket = get_bucket(node);
+        // the points within the max distance fill the heap, then only the ones closer than its top are offered
+        const double max_bound = std::nextafter(budget.sqr_max_dist, std::numeric_limits<double>::infinity());
+        auto bound = [&heap, k, &point, max_bound] {
+            return (heap.size() < k) ? max_bound : point.sqr_distance(*heap.front());
+        };
+        for (std::size_t i = detail::find_closer(bucket, 0, node.count, point, bound()); i < node.count;
+             i = detail::find_closer(bucket, i + 1, node.count, point, bound())) {
+            offer(bucket + i);
+        }
+        return;
+    }
+    if (!node.erased && point.sqr_distance(node.point) <= budget.sqr_max_dist) {
+        KDTREE_COUNT(distance_evaluations, 1);
+        offer(&node.point);
+    }
+    const bool go_left = less(point, node.point, check_x);
+    nearest(go_left ? node.left : node.right, point, k, !check_x, heap, budget);
+    nearest(go_left ? node.right : node.left, point, k, !check_x, heap, budget);
 }
 
 std::pair<kdtree::PointSet::iterator, kdtree::PointSet::iterator> kdtree::PointSet::nearest(const Point & point, std::size_t k) const
@@ -601,22 +1438,69 @@ std::pair<kdtree::PointSet::iterator, kdtree::PointSet::iterator> kdtree::PointS
     if (k >= size()) {
         return {begin(), end()};
     }
-    std::vector<NodePtr> heap(k);
-    NodePtr current = begin(m_root);
-    for (std::size_t i = 0; i < k; ++i) {
-        heap[i] = current;
-        current = next(current);
+    return {iterator(this, k_nearest(point, k)), iterator()};
+}
+
+std::pair<kdtree::PointSet::iterator, kdtree::PointSet::iterator> kdtree::PointSet::nearest(const Point & point, std::size_t k, double max_dist) const
+{
+    if (k == 0 || !(max_dist >= 0)) {
+        return {iterator(), iterator()};
+    }
+    return {iterator(this, k_nearest(point, k, max_dist * max_dist)), iterator()};
+}
+
+std::pair<kdtree::PointSet::iterator, kdtree::PointSet::iterator> kdtree::PointSet::within_radius(const Point & point, double radius) const
+{
+    iterator::list_t points;
+    within_radius_for_each(point, radius, [&points](const Point & candidate) {
+        points.push_back(&candidate);
+    });
+    return {iterator(this, std::move(points)), iterator()};
+}
+
+std::vector<const Point *> kdtree::PointSet::k_nearest(const Point & point, const std::size_t k, const double sqr_max_dist) const
+{
+    std::vector<const Point *> heap;
+    if (k == 0) {
+        return heap;
     }
-    auto less_dist = [&point](const NodePtr & lhs, const NodePtr & rhs) {
-        return point.distance(lhs->point) < point.distance(rhs->point);
-    };
-    std::make_heap(heap.begin(), heap.end(), less_dist);
-    for (; current != nullptr; current = next(current)) {
-        if (less_dist(current, heap.front())) {
-            std::pop_heap(heap.begin(), heap.end(), less_dist);
-            heap.back() = current;
-            std::push_heap(heap.begin(), heap.end(), less_dist);
-        }
+    heap.reserve(std::min(k, size()));
+    SearchBudget budget;
+    budget.sqr_max_dist = sqr_max_dist;
+    nearest(m_root, point, k, true, heap, budget);
+    return heap;
+}
+
+std::pair<std::optional<Point>, bool> kdtree::PointSet::nearest_approx(const Point & point, const double eps, const std::size_t max_nodes) const
+{
+    SearchBudget budget;
+    budget.shrink = (1 + eps) * (1 + eps);
+    budget.nodes = max_nodes;
+    const Point * result = nearest(point, budget);
+    return {(result != nullptr) ? std::optional<Point>(*result) : std::optional<Point>(), !budget.exhausted};
+}
+
+std::pair<std::vector<Point>, bool> kdtree::PointSet::nearest_approx(const Point & point,
+                                                                     const std::size_t k,
+                                                                     const double eps,
+                                                                     const std::size_t max_nodes) const
+{
+    std::vector<const Point *> heap;
+    if (k == 0) {
+        return {{}, true};
+    }
+    heap.reserve(std::min(k, size()));
+    SearchBudget budget;
+    budget.shrink = (1 + eps) * (1 + eps);
+    budget.nodes = max_nodes;
+    nearest(m_root, point, k, true, heap, budget);
+    std::sort_heap(heap.begin(), heap.end(), [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    });
+    std::vector<Point> result;
+    result.reserve(heap.size());
+    for (const Point * candidate : heap) {
+        result.push_back(*candidate);
     }
-    return {iterator(std::move(heap)), iterator()};
+    return {std::move(result), !budget.exhausted};
 }
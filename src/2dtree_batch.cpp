@@ -0,0 +1,76 @@
+#include "morton.h"
+#include "parallel.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+// Order in which the queries are processed: neighbouring queries touch the same nodes
+template <class T, class Key>
+std::vector<std::size_t> z_order(const std::vector<T> & queries, Key && key)
+{
+    std::vector<std::size_t> order(queries.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (queries.empty()) {
+        return order;
+    }
+    double xmin = std::numeric_limits<double>::max();
+    double ymin = xmin;
+    double xmax = std::numeric_limits<double>::lowest();
+    double ymax = xmax;
+    for (const T & query : queries) {
+        const Point point = key(query);
+        xmin = std::min(xmin, point.x());
+        ymin = std::min(ymin, point.y());
+        xmax = std::max(xmax, point.x());
+        ymax = std::max(ymax, point.y());
+    }
+    const Rect bounds({xmin, ymin}, {xmax, ymax});
+    std::vector<std::uint64_t> codes(queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i) {
+        codes[i] = detail::morton_code(key(queries[i]), bounds);
+    }
+    std::sort(order.begin(), order.end(), [&codes](const std::size_t lhs, const std::size_t rhs) {
+        return codes[lhs] < codes[rhs];
+    });
+    return order;
+}
+
+} // namespace
+
+void kdtree::PointSet::nearest_batch(const std::vector<Point> & queries,
+                                     std::vector<std::optional<Point>> & result,
+                                     const std::size_t threads) const
+{
+    const std::vector<std::size_t> order = z_order(queries, [](const Point & query) {
+        return query;
+    });
+    result.assign(queries.size(), std::nullopt);
+    detail::parallel_for(order.size(), detail::thread_count(threads), [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            result[order[i]] = nearest(queries[order[i]]);
+        }
+    });
+}
+
+void kdtree::PointSet::range_batch(const std::vector<Rect> & queries,
+                                   std::vector<std::vector<Point>> & result,
+                                   const std::size_t threads) const
+{
+    const std::vector<std::size_t> order = z_order(queries, [](const Rect & query) {
+        return Point((query.xmin() + query.xmax()) / 2, (query.ymin() + query.ymax()) / 2);
+    });
+    result.resize(queries.size());
+    detail::parallel_for(order.size(), detail::thread_count(threads), [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            std::vector<Point> & points = result[order[i]];
+            points.clear();
+            range_for_each(queries[order[i]], [&points](const Point & point) {
+                points.push_back(point);
+            });
+        }
+    });
+}
@@ -0,0 +1,92 @@
+#include "primitives.h"
+
+kdtree::ConcurrentPointSet::ConcurrentPointSet()
+    : m_current(std::make_shared<const PointSet>())
+{
+}
+
+kdtree::ConcurrentPointSet::ConcurrentPointSet(PointSet && point_set)
+    : m_current(std::make_shared<const PointSet>(std::move(point_set)))
+{
+}
+
+std::shared_ptr<const kdtree::PointSet> kdtree::ConcurrentPointSet::snapshot() const
+{
+    return std::atomic_load(&m_current);
+}
+
+std::size_t kdtree::ConcurrentPointSet::apply(Update && update)
+{
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    auto next = std::make_shared<PointSet>(*std::atomic_load(&m_current));
+    const std::size_t size = next->size();
+    update(*next);
+    const std::size_t removed = size - std::min(size, next->size());
+    std::atomic_store(&m_current, std::shared_ptr<const PointSet>(std::move(next)));
+    if (m_logging) {
+        m_log.push_back(std::move(update));
+    }
+    return removed;
+}
+
+void kdtree::ConcurrentPointSet::put(const Point & point)
+{
+    apply([point](PointSet & point_set) {
+        point_set.put(point);
+    });
+}
+
+void kdtree::ConcurrentPointSet::put(const std::vector<Point> & points)
+{
+    apply([points](PointSet & point_set) {
+        point_set.put_range(points);
+    });
+}
+
+std::size_t kdtree::ConcurrentPointSet::erase(const Point & point)
+{
+    return apply([point](PointSet & point_set) {
+        point_set.erase(point);
+    });
+}
+
+std::size_t kdtree::ConcurrentPointSet::erase(const Rect & rect)
+{
+    return apply([rect](PointSet & point_set) {
+        point_set.erase(rect);
+    });
+}
+
+void kdtree::ConcurrentPointSet::maintain()
+{
+    std::lock_guard<std::mutex> maintain_lock(m_maintain_mutex);
+    std::shared_ptr<const PointSet> current;
+    {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        current = std::atomic_load(&m_current);
+        m_logging = true;
+        m_replayable = true;
+    }
+    std::shared_ptr<PointSet> next;
+    try {
+        next = std::make_shared<PointSet>(*current);
+        next->maintain();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(m_write_mutex);
+        m_logging = false;
+        m_log.clear();
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    m_logging = false;
+    std::vector<Update> log;
+    log.swap(m_log);
+    if (!m_replayable) {
+        return;
+    }
+    for (Update & update : log) {
+        update(*next);
+    }
+    std::atomic_store(&m_current, std::shared_ptr<const PointSet>(std::move(next)));
+}
@@ -0,0 +1,162 @@
+#include "mapped_file.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+constexpr char magic[8] = {'2', 'D', 'T', 'R', 'E', 'E', '\0', '\0'};
+constexpr std::uint32_t format_version = 5;
+// Reads as 0x04030201 when the file was written on a machine with the other byte order
+constexpr std::uint32_t byte_order_mark = 0x01020304;
+
+struct FileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint32_t node_size;
+    std::uint32_t root;
+    std::uint64_t node_count;
+    // Bucket storage follows the nodes
+    std::uint64_t leaf_size;
+    std::uint64_t point_count;
+    // The rest of BuildOptions that decides how the loaded tree is rebalanced
+    double alpha;
+    std::uint64_t rebuild_limit;
+};
+
+static_assert(sizeof(FileHeader) % alignof(double) == 0, "Nodes following the header have to stay aligned");
+
+// Copies the nodes field by field into zeroed memory before writing them, so that no
+// uninitialised padding goes to the file and the same tree is always saved to the same bytes
+template <class Node>
+void write_nodes(std::ofstream & file, const Node * nodes, const std::size_t count)
+{
+    constexpr std::size_t batch_size = 4096;
+    std::vector<char> buffer(std::min(count, batch_size) * sizeof(Node));
+    for (std::size_t first = 0; first < count; first += batch_size) {
+        const std::size_t size = std::min(count - first, batch_size);
+        std::fill(buffer.begin(), buffer.end(), 0);
+        Node * staged = reinterpret_cast<Node *>(buffer.data());
+        for (std::size_t i = 0; i < size; ++i) {
+            const Node & node = nodes[first + i];
+            staged[i].point = node.point;
+            staged[i].rect = node.rect;
+            staged[i].size = node.size;
+            staged[i].count = node.count;
+            staged[i].left = node.left;
+            staged[i].right = node.right;
+            staged[i].parent = node.parent;
+            staged[i].bucket = node.bucket;
+            staged[i].erased = node.erased;
+        }
+        file.write(buffer.data(), static_cast<std::streamsize>(size * sizeof(Node)));
+    }
+}
+
+} // namespace
+
+void kdtree::PointSet::save(const std::string & filename) const
+{
+    static_assert(std::is_trivially_copyable_v<Node>, "Nodes are written and mapped as raw bytes");
+    FileHeader header = {};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = format_version;
+    header.byte_order = byte_order_mark;
+    header.node_size = sizeof(Node);
+    header.root = m_root;
+    // The pool of a tree with every point erased may still hold freed nodes, none is written
+    header.node_count = (m_root != nil) ? node_count() : 0;
+    header.leaf_size = m_options.leaf_size;
+    header.point_count = (m_root != nil) ? bucket_storage_size() : 0;
+    header.alpha = m_options.alpha;
+    header.rebuild_limit = m_options.rebuild_limit;
+
+    // A loaded set reads its nodes from the mapping of the file it may be saved to, and other
+    // processes may have it mapped too, so the file is replaced by a new one instead of rewritten
+    const std::string temporary = filename + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (header.node_count != 0) {
+        write_nodes(file, &get_node(0), header.node_count);
+    }
+    if (header.point_count != 0) {
+        const Point * points = (m_mapped_nodes != nullptr) ? m_mapped_points : m_points.data();
+        file.write(reinterpret_cast<const char *>(points), static_cast<std::streamsize>(header.point_count * sizeof(Point)));
+    }
+    file.close();
+    if (!file) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("kdtree::PointSet: can not write " + filename);
+    }
+    // std::rename() does not replace an existing file on every platform
+    if (std::rename(temporary.c_str(), filename.c_str()) != 0 &&
+        (std::remove(filename.c_str()) != 0 || std::rename(temporary.c_str(), filename.c_str()) != 0)) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("kdtree::PointSet: can not write " + filename);
+    }
+}
+
+kdtree::PointSet kdtree::PointSet::load(const std::string & filename)
+{
+    auto mapping = std::make_shared<const detail::MappedFile>(filename, detail::MappedFile::Access::Random);
+    if (!mapping->is_open()) {
+        throw std::runtime_error("kdtree::PointSet: can not open " + filename);
+    }
+    FileHeader header = {};
+    if (mapping->size() < sizeof(header)) {
+        throw std::runtime_error("kdtree::PointSet: " + filename + " is too short");
+    }
+    std::memcpy(&header, mapping->data(), sizeof(header));
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("kdtree::PointSet: " + filename + " is not a saved tree");
+    }
+    if (header.byte_order != byte_order_mark) {
+        throw std::runtime_error("kdtree::PointSet: " + filename + " was saved with another byte order");
+    }
+    if (header.version != format_version || header.node_size != sizeof(Node)) {
+        throw std::runtime_error("kdtree::PointSet: " + filename + " has an unsupported format version");
+    }
+    if (header.node_count >= nil || header.point_count >= nil ||
+        header.leaf_size == 0 || header.point_count % header.leaf_size != 0 ||
+        !(header.alpha >= 0.5 && header.alpha <= 1.0) ||
+        (mapping->size() - sizeof(header)) / sizeof(Node) < header.node_count ||
+        (mapping->size() - sizeof(header) - header.node_count * sizeof(Node)) / sizeof(Point) < header.point_count ||
+        (header.node_count == 0) != (header.root == nil) ||
+        (header.root != nil && header.root >= header.node_count)) {
+        throw std::runtime_error("kdtree::PointSet: " + filename + " is corrupted");
+    }
+    const Node * nodes = reinterpret_cast<const Node *>(mapping->data() + sizeof(header));
+    auto valid_index = [&header](const index_t index) {
+        return index == nil || index < header.node_count;
+    };
+    for (std::size_t i = 0; i < header.node_count; ++i) {
+        const Node & node = nodes[i];
+        if (!valid_index(node.left) || !valid_index(node.right) || !valid_index(node.parent) ||
+            (node.bucket != nil && (node.bucket > header.point_count || header.point_count - node.bucket < node.count))) {
+            throw std::runtime_error("kdtree::PointSet: " + filename + " is corrupted");
+        }
+    }
+
+    BuildOptions options;
+    options.leaf_size = header.leaf_size;
+    options.alpha = header.alpha;
+    options.rebuild_limit = header.rebuild_limit;
+    PointSet result(options);
+    if (header.node_count != 0) {
+        result.m_root = header.root;
+        result.m_mapped_nodes = nodes;
+        result.m_mapped_count = header.node_count;
+        result.m_mapped_points = reinterpret_cast<const Point *>(nodes + header.node_count);
+        result.m_mapped_point_count = header.point_count;
+        result.m_mapping = std::move(mapping);
+    }
+    return result;
+}
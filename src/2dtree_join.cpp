@@ -0,0 +1,492 @@
+#include "parallel.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Query subtrees of at most this many points are joined as a range of points
+constexpr std::size_t join_block = 16;
+
+// Squared distance between the closest points of the rects
+double sqr_distance(const Rect & lhs, const Rect & rhs)
+{
+    const double dx = std::max(std::max(lhs.xmin() - rhs.xmax(), rhs.xmin() - lhs.xmax()), 0.0);
+    const double dy = std::max(std::max(lhs.ymin() - rhs.ymax(), rhs.ymin() - lhs.ymax()), 0.0);
+    return dx * dx + dy * dy;
+}
+
+} // namespace
+
+// The points of the query set are laid out in pre-order of its tree, so that every subtree
+// takes a contiguous range of them starting with the points of its root. A pair of a query
+// and a reference subtree goes down the reference child containing the query subtree first,
+// otherwise the query subtree is split. Small query subtrees are walked down the reference
+// subtree together as a range of points, each of them leaving the walk once the subtrees
+// are farther than its bound. The policies decide which points are taken and the bounds.
+class kdtree::PointSet::Join
+{
+public:
+    Join(const PointSet & queries, const PointSet & references);
+
+    // Every query subtree of the task is joined with the whole reference tree, the tasks
+    // share no query points. own is set for the tasks of the points of the node alone.
+    struct Task
+    {
+        index_t node;
+        bool own;
+    };
+
+    // The top levels of the query tree are split into at least count tasks
+    std::vector<Task> tasks(std::size_t count) const;
+
+    template <class Policy>
+    void run(const Task & task, Policy & policy);
+
+    // Keeps the nearest reference point of every query point, the bound of a query subtree
+    // is the largest distance to the nearest point found so far in it
+    class Nearest;
+    // Collects the pairs within the radius
+    class Within;
+
+    void nearest_result(std::vector<std::pair<Point, Point>> & result) const;
+
+private:
+    struct Range
+    {
+        std::size_t begin = 0;
+        // End of the points of the node itself
+        std::size_t own_end = 0;
+        std::size_t end = 0;
+    };
+
+    void flatten(index_t node);
+    void split(index_t node, std::size_t depth, std::vector<Task> & tasks) const;
+    bool is_small(index_t node) const;
+
+    // Points of the node itself
+    static std::pair<const Point *, std::size_t> own_points(const PointSet & set, const Node & node);
+
+    // active holds the indices of the query points taking part in the walks down the reference tree
+    template <class Policy>
+    void join(index_t query, index_t reference, Policy & policy, std::vector<std::size_t> & active);
+    template <class Policy>
+    void join_points(std::size_t begin,
+                     std::size_t end,
+                     const Rect & rect,
+                     index_t reference,
+                     Policy & policy,
+                     std::vector<std::size_t> & active);
+    // The active query points from first on that may find a point in the reference subtree
+    // are appended to active and go on into the subtree, rect holds all of them
+    template <class Policy>
+    void descend(std::size_t first, const Rect & rect, index_t reference, Policy & policy, std::vector<std::size_t> & active);
+    // Child of the reference node whose rect contains the rect, nil if there is none
+    index_t containing_child(const Node & node, const Rect & rect) const;
+    // Children of the reference node ordered by the distance of their rects to the rect
+    std::array<index_t, 2> children_by_distance(const Node & node, const Rect & rect) const;
+
+    const PointSet & m_queries;
+    const PointSet & m_references;
+    // Indexed by the query nodes
+    std::vector<Range> m_ranges;
+    std::vector<double> m_bounds;
+    // Indexed by the query points
+    std::vector<const Point *> m_points;
+    std::vector<double> m_best;
+    std::vector<const Point *> m_nearest;
+};
+
+class kdtree::PointSet::Join::Nearest
+{
+public:
+    Nearest(Join & join)
+        : m_join(join)
+    {
+    }
+
+    double bound(const index_t query) const
+    {
+        return m_join.m_bounds[query];
+    }
+
+    bool reaches(const std::size_t index, const Rect & rect) const
+    {
+        return rect.sqr_distance(*m_join.m_points[index]) < m_join.m_best[index];
+    }
+
+    void scan(const std::size_t index, const Point * points, const std::size_t count)
+    {
+        const Point & point = *m_join.m_points[index];
+        double & best = m_join.m_best[index];
+        // single points skip the dispatch of the vector kernels
+        if (count == 1) {
+            const double distance = point.sqr_distance(*points);
+            if (distance < best) {
+                best = distance;
+                m_join.m_nearest[index] = points;
+            }
+            return;
+        }
+        for (std::size_t i = detail::find_closer(points, 0, count, point, best); i < count;
+             i = detail::find_closer(points, i + 1, count, point, best)) {
+            best = point.sqr_distance(points[i]);
+            m_join.m_nearest[index] = points + i;
+        }
+    }
+
+    // The bounds of the children are never smaller than the distances in them, so a parent
+    // takes the largest of them and of its own points
+    void finish(const index_t query)
+    {
+        const Range & range = m_join.m_ranges[query];
+        if (m_join.is_small(query)) {
+            m_join.m_bounds[query] = largest(range.begin, range.end);
+            return;
+        }
+        const Node & node = m_join.m_queries.get_node(query);
+        double result = largest(range.begin, range.own_end);
+        for (const index_t child : {node.left, node.right}) {
+            if (child != nil && m_join.m_queries.get_node(child).size != 0) {
+                result = std::max(result, m_join.m_bounds[child]);
+            }
+        }
+        m_join.m_bounds[query] = result;
+    }
+
+private:
+    double largest(const std::size_t begin, const std::size_t end) const
+    {
+        double result = 0;
+        for (std::size_t i = begin; i < end; ++i) {
+            result = std::max(result, m_join.m_best[i]);
+        }
+        return result;
+    }
+
+    Join & m_join;
+};
+
+class kdtree::PointSet::Join::Within
+{
+public:
+    Within(Join & join, const double radius, std::vector<std::pair<Point, Point>> & result)
+        : m_join(join)
+        , m_sqr_radius(radius * radius)
+        , m_scan_bound(std::nextafter(m_sqr_radius, std::numeric_limits<double>::infinity()))
+        , m_result(result)
+    {
+    }
+
+    double bound(index_t) const
+    {
+        return m_sqr_radius;
+    }
+
+    bool reaches(const std::size_t index, const Rect & rect) const
+    {
+        return rect.sqr_distance(*m_join.m_points[index]) <= m_sqr_radius;
+    }
+
+    void scan(const std::size_t index, const Point * points, const std::size_t count)
+    {
+        const Point & point = *m_join.m_points[index];
+        if (count == 1) {
+            if (point.sqr_distance(*points) <= m_sqr_radius) {
+                m_result.emplace_back(point, *points);
+            }
+            return;
+        }
+        // points strictly closer than the bound are at most at the radius
+        for (std::size_t i = detail::find_closer(points, 0, count, point, m_scan_bound); i < count;
+             i = detail::find_closer(points, i + 1, count, point, m_scan_bound)) {
+            m_result.emplace_back(point, points[i]);
+        }
+    }
+
+    void finish(index_t)
+    {
+    }
+
+private:
+    Join & m_join;
+    const double m_sqr_radius;
+    const double m_scan_bound;
+    std::vector<std::pair<Point, Point>> & m_result;
+};
+
+kdtree::PointSet::Join::Join(const PointSet & queries, const PointSet & references)
+    : m_queries(queries)
+    , m_references(references)
+    , m_ranges(queries.node_count())
+    , m_bounds(queries.node_count(), std::numeric_limits<double>::infinity())
+{
+    m_points.reserve(queries.size());
+    flatten(queries.m_root);
+    m_best.assign(m_points.size(), std::numeric_limits<double>::infinity());
+    m_nearest.assign(m_points.size(), nullptr);
+}
+
+void kdtree::PointSet::Join::flatten(const index_t node)
+{
+    if (node == nil) {
+        return;
+    }
+    const Node & query = m_queries.get_node(node);
+    const auto [points, count] = own_points(m_queries, query);
+    Range & range = m_ranges[node];
+    range.begin = m_points.size();
+    for (std::size_t i = 0; i < count; ++i) {
+        m_points.push_back(points + i);
+    }
+    range.own_end = m_points.size();
+    flatten(query.left);
+    flatten(query.right);
+    m_ranges[node].end = m_points.size();
+}
+
+bool kdtree::PointSet::Join::is_small(const index_t node) const
+{
+    const Range & range = m_ranges[node];
+    const Node & query = m_queries.get_node(node);
+    return range.end - range.begin <= join_block || (query.left == nil && query.right == nil);
+}
+
+std::pair<const Point *, std::size_t> kdtree::PointSet::Join::own_points(const PointSet & set, const Node & node)
+{
+    if (node.bucket != nil) {
+        return {set.get_bucket(node), node.count};
+    }
+    return {&node.point, node.erased ? 0 : 1};
+}
+
+std::vector<kdtree::PointSet::Join::Task> kdtree::PointSet::Join::tasks(const std::size_t count) const
+{
+    std::vector<Task> result;
+    if (m_queries.m_root == nil || m_references.m_root == nil) {
+        return result;
+    }
+    std::size_t depth = 0;
+    while ((std::size_t(1) << depth) < count) {
+        ++depth;
+    }
+    split(m_queries.m_root, depth, result);
+    return result;
+}
+
+void kdtree::PointSet::Join::split(const index_t node, const std::size_t depth, std::vector<Task> & tasks) const
+{
+    if (node == nil || m_queries.get_node(node).size == 0) {
+        return;
+    }
+    if (depth == 0 || is_small(node)) {
+        tasks.push_back({node, false});
+        return;
+    }
+    const Range & range = m_ranges[node];
+    if (range.begin < range.own_end) {
+        tasks.push_back({node, true});
+    }
+    const Node & query = m_queries.get_node(node);
+    split(query.left, depth - 1, tasks);
+    split(query.right, depth - 1, tasks);
+}
+
+template <class Policy>
+void kdtree::PointSet::Join::run(const Task & task, Policy & policy)
+{
+    std::vector<std::size_t> active;
+    if (!task.own) {
+        join(task.node, m_references.m_root, policy, active);
+        return;
+    }
+    const Range & range = m_ranges[task.node];
+    const Point & point = m_queries.get_node(task.node).point;
+    join_points(range.begin, range.own_end, Rect(point, point), m_references.m_root, policy, active);
+}
+
+kdtree::PointSet::index_t kdtree::PointSet::Join::containing_child(const Node & node, const Rect & rect) const
+{
+    for (const index_t child : {node.left, node.right}) {
+        if (child != nil && m_references.get_node(child).size != 0 && m_references.get_node(child).rect.contains(rect)) {
+            return child;
+        }
+    }
+    return nil;
+}
+
+std::array<kdtree::PointSet::index_t, 2> kdtree::PointSet::Join::children_by_distance(const Node & node, const Rect & rect) const
+{
+    std::array<index_t, 2> result = {node.left, node.right};
+    if (result[0] != nil && result[1] != nil &&
+        sqr_distance(m_references.get_node(result[1]).rect, rect) < sqr_distance(m_references.get_node(result[0]).rect, rect)) {
+        std::swap(result[0], result[1]);
+    }
+    return result;
+}
+
+template <class Policy>
+void kdtree::PointSet::Join::join(const index_t query,
+                                  const index_t reference,
+                                  Policy & policy,
+                                  std::vector<std::size_t> & active)
+{
+    const Node & query_node = m_queries.get_node(query);
+    const Node & reference_node = m_references.get_node(reference);
+    if (query_node.size == 0 || reference_node.size == 0 ||
+        sqr_distance(query_node.rect, reference_node.rect) > policy.bound(query)) {
+        KDTREE_COUNT(subtrees_pruned, 1);
+        return;
+    }
+    const Range & range = m_ranges[query];
+    if (is_small(query)) {
+        join_points(range.begin, range.end, query_node.rect, reference, policy, active);
+    }
+    else if (const index_t inner = containing_child(reference_node, query_node.rect); inner != nil) {
+        // the query subtree lies in a child of the reference node and is joined with it first,
+        // the rest of the reference subtree is usually skipped after that by the bound
+        KDTREE_COUNT(nodes_visited, 1);
+        join(query, inner, policy, active);
+        const index_t outer = (inner == reference_node.left) ? reference_node.right : reference_node.left;
+        if (outer != nil) {
+            join(query, outer, policy, active);
+        }
+        const auto [points, count] = own_points(m_references, reference_node);
+        for (std::size_t i = 0; i < count; ++i) {
+            if (query_node.rect.sqr_distance(points[i]) <= policy.bound(query)) {
+                KDTREE_COUNT(distance_evaluations, range.end - range.begin);
+                for (std::size_t j = range.begin; j < range.end; ++j) {
+                    policy.scan(j, points + i, 1);
+                }
+            }
+        }
+    }
+    else {
+        if (range.begin < range.own_end) {
+            join_points(range.begin, range.own_end, Rect(query_node.point, query_node.point), reference, policy, active);
+        }
+        for (const index_t child : {query_node.left, query_node.right}) {
+            if (child != nil) {
+                join(child, reference, policy, active);
+            }
+        }
+    }
+    policy.finish(query);
+}
+
+template <class Policy>
+void kdtree::PointSet::Join::join_points(const std::size_t begin,
+                                         const std::size_t end,
+                                         const Rect & rect,
+                                         const index_t reference,
+                                         Policy & policy,
+                                         std::vector<std::size_t> & active)
+{
+    const std::size_t first = active.size();
+    for (std::size_t i = begin; i < end; ++i) {
+        active.push_back(i);
+    }
+    descend(first, rect, reference, policy, active);
+    active.resize(first);
+}
+
+template <class Policy>
+void kdtree::PointSet::Join::descend(const std::size_t first,
+                                     const Rect & rect,
+                                     const index_t reference,
+                                     Policy & policy,
+                                     std::vector<std::size_t> & active)
+{
+    const Node & node = m_references.get_node(reference);
+    const std::size_t last = active.size();
+    if (node.size == 0) {
+        return;
+    }
+    if (node.rect.contains(rect)) {
+        // every point of the range is inside the subtree and may find a point in it
+        active.insert(active.end(), active.begin() + static_cast<std::ptrdiff_t>(first), active.begin() + static_cast<std::ptrdiff_t>(last));
+    }
+    else {
+        for (std::size_t i = first; i < last; ++i) {
+            if (policy.reaches(active[i], node.rect)) {
+                active.push_back(active[i]);
+            }
+        }
+    }
+    if (active.size() == last) {
+        KDTREE_COUNT(subtrees_pruned, 1);
+        return;
+    }
+    KDTREE_COUNT(nodes_visited, 1);
+    const auto [points, count] = own_points(m_references, node);
+    if (count != 0) {
+        KDTREE_COUNT(distance_evaluations, (active.size() - last) * count);
+        for (std::size_t i = last; i < active.size(); ++i) {
+            policy.scan(active[i], points, count);
+        }
+    }
+    for (const index_t child : children_by_distance(node, rect)) {
+        if (child != nil) {
+            descend(last, rect, child, policy, active);
+        }
+    }
+    active.resize(last);
+}
+
+void kdtree::PointSet::Join::nearest_result(std::vector<std::pair<Point, Point>> & result) const
+{
+    result.clear();
+    result.reserve(m_points.size());
+    for (std::size_t i = 0; i < m_points.size(); ++i) {
+        if (m_nearest[i] != nullptr) {
+            result.emplace_back(*m_points[i], *m_nearest[i]);
+        }
+    }
+}
+
+void kdtree::PointSet::nearest_join(const PointSet & other,
+                                    std::vector<std::pair<Point, Point>> & result,
+                                    const std::size_t threads) const
+{
+    Join join(*this, other);
+    const std::size_t count = detail::thread_count(threads);
+    // a few tasks per thread even out the subtrees of different cost
+    const std::vector<Join::Task> tasks = join.tasks((count > 1) ? 4 * count : 1);
+    detail::parallel_for(tasks.size(), count, [&join, &tasks](const std::size_t begin, const std::size_t end) {
+        Join::Nearest policy(join);
+        for (std::size_t i = begin; i < end; ++i) {
+            join.run(tasks[i], policy);
+        }
+    });
+    join.nearest_result(result);
+}
+
+void kdtree::PointSet::radius_join(const PointSet & other,
+                                   const double radius,
+                                   std::vector<std::pair<Point, Point>> & result,
+                                   const std::size_t threads) const
+{
+    result.clear();
+    if (!(radius >= 0)) {
+        return;
+    }
+    Join join(*this, other);
+    const std::size_t count = detail::thread_count(threads);
+    const std::vector<Join::Task> tasks = join.tasks((count > 1) ? 4 * count : 1);
+    std::vector<std::vector<std::pair<Point, Point>>> parts(tasks.size());
+    detail::parallel_for(tasks.size(), count, [&join, &tasks, &parts, radius](const std::size_t begin, const std::size_t end) {
+        for (std::size_t i = begin; i < end; ++i) {
+            Join::Within policy(join, radius, parts[i]);
+            join.run(tasks[i], policy);
+        }
+    });
+    if (parts.empty()) {
+        return;
+    }
+    result = std::move(parts.front());
+    for (std::size_t i = 1; i < parts.size(); ++i) {
+        result.insert(result.end(), parts[i].begin(), parts[i].end());
+    }
+}
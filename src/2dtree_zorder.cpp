@@ -0,0 +1,453 @@
+#include "morton.h"
+#include "point_reader.h"
+#include "primitives.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+
+constexpr double eps = std::numeric_limits<double>::epsilon();
+
+// Bits of a code from the given one down that belong to its coordinate, x takes the even bits
+std::uint64_t coordinate_bits(const unsigned bit)
+{
+    constexpr std::uint64_t x_bits = 0x5555555555555555;
+    const std::uint64_t below = (bit == 63) ? std::numeric_limits<std::uint64_t>::max() : (std::uint64_t(1) << (bit + 1)) - 1;
+    return ((bit % 2 == 0) ? x_bits : x_bits << 1) & below;
+}
+
+// Smallest code of at least z with both coordinates between the ones of zmin and zmax, the
+// BIGMIN of Tropf and Herzog. Returns false if there is none.
+bool next_in_box(const std::uint64_t z, std::uint64_t zmin, std::uint64_t zmax, std::uint64_t & result)
+{
+    bool found = false;
+    for (unsigned bit = 64; bit-- > 0;) {
+        const std::uint64_t single = std::uint64_t(1) << bit;
+        const std::uint64_t mask = coordinate_bits(bit);
+        // the coordinate goes to the upper or to the lower half of the box
+        auto upper = [single, mask](const std::uint64_t value) {
+            return (value & ~mask) | single;
+        };
+        auto lower = [single, mask](const std::uint64_t value) {
+            return (value & ~mask) | (mask & ~single);
+        };
+        const bool in_z = (z & single) != 0;
+        const bool in_min = (zmin & single) != 0;
+        const bool in_max = (zmax & single) != 0;
+        if (!in_z && !in_min && in_max) {
+            // z follows the lower half, the upper one is the fallback
+            result = upper(zmin);
+            found = true;
+            zmax = lower(zmax);
+        }
+        else if (!in_z && in_min) {
+            // z is below the box
+            result = zmin;
+            return true;
+        }
+        else if (in_z && !in_max) {
+            // z is above the box
+            return found;
+        }
+        else if (in_z && !in_min) {
+            zmin = upper(zmin);
+        }
+    }
+    result = z;
+    return true;
+}
+
+} // namespace
+
+zorder::PointSet::iterator::iterator(std::vector<pointer> && points)
+    : m_data(std::move(points))
+{
+}
+
+zorder::PointSet::iterator::iterator(const pointer point)
+    : m_data(point)
+{
+}
+
+zorder::PointSet::iterator::iterator(const PointSet * set, range_t && range)
+    : m_set(set)
+    , m_data(std::move(range))
+{
+    find_in_range();
+}
+
+void zorder::PointSet::iterator::find_in_range()
+{
+    auto & range = std::get<range_t>(m_data);
+    const std::size_t blocks = m_set->block_count();
+    for (std::size_t block = m_set->find_block(range.window, range.index / block_size); block < blocks;
+         block = m_set->find_block(range.window, block + 1)) {
+        const std::size_t end = m_set->block_end(block);
+        range.index = detail::find_in_rect(m_set->m_points.data(), std::max(range.index, block * block_size), end, range.window.rect);
+        if (range.index < end) {
+            return;
+        }
+    }
+    m_data = data_type();
+}
+
+zorder::PointSet::iterator::reference zorder::PointSet::iterator::operator*() const
+{
+    return *operator->();
+}
+
+zorder::PointSet::iterator::pointer zorder::PointSet::iterator::operator->() const
+{
+    switch (m_data.index()) {
+    case 0: return std::get<0>(m_data).back();
+    case 1: return std::get<1>(m_data);
+    default: return m_set->m_points.data() + std::get<2>(m_data).index;
+    }
+}
+
+zorder::PointSet::iterator & zorder::PointSet::iterator::operator++()
+{
+    switch (m_data.index()) {
+    case 0:
+        std::get<0>(m_data).pop_back();
+        break;
+    case 1:
+        ++std::get<1>(m_data);
+        break;
+    default:
+        ++std::get<2>(m_data).index;
+        find_in_range();
+        break;
+    }
+    return *this;
+}
+
+zorder::PointSet::iterator zorder::PointSet::iterator::operator++(int)
+{
+    auto cpy = *this;
+    operator++();
+    return cpy;
+}
+
+zorder::PointSet::PointSet(const std::string & filename)
+    : m_points(detail::read_points(filename))
+{
+    build();
+}
+
+void zorder::PointSet::build()
+{
+    m_codes.clear();
+    m_blocks.clear();
+    if (m_points.empty()) {
+        m_bounds = Rect(Point(0, 0), Point(0, 0));
+        return;
+    }
+    double xmin = std::numeric_limits<double>::max();
+    double ymin = xmin;
+    double xmax = std::numeric_limits<double>::lowest();
+    double ymax = xmax;
+    for (const Point & point : m_points) {
+        xmin = std::min(xmin, point.x());
+        ymin = std::min(ymin, point.y());
+        xmax = std::max(xmax, point.x());
+        ymax = std::max(ymax, point.y());
+    }
+    m_bounds = Rect(Point(xmin, ymin), Point(xmax, ymax));
+    std::vector<std::pair<std::uint64_t, Point>> coded;
+    coded.reserve(m_points.size());
+    for (const Point & point : m_points) {
+        coded.emplace_back(detail::morton_code(point, m_bounds), point);
+    }
+    std::sort(coded.begin(), coded.end(), [](const auto & lhs, const auto & rhs) {
+        return lhs.first < rhs.first;
+    });
+    m_points.clear();
+    m_codes.reserve(coded.size());
+    for (const auto & [code, point] : coded) {
+        m_codes.push_back(code);
+        m_points.push_back(point);
+    }
+    update_blocks(0);
+}
+
+void zorder::PointSet::update_blocks(const std::size_t first)
+{
+    m_blocks.erase(m_blocks.begin() + static_cast<std::ptrdiff_t>(std::min(first, m_blocks.size())), m_blocks.end());
+    for (std::size_t begin = first * block_size; begin < m_points.size(); begin += block_size) {
+        double xmin = std::numeric_limits<double>::max();
+        double ymin = xmin;
+        double xmax = std::numeric_limits<double>::lowest();
+        double ymax = xmax;
+        for (std::size_t i = begin, end = std::min(begin + block_size, m_points.size()); i < end; ++i) {
+            xmin = std::min(xmin, m_points[i].x());
+            ymin = std::min(ymin, m_points[i].y());
+            xmax = std::max(xmax, m_points[i].x());
+            ymax = std::max(ymax, m_points[i].y());
+        }
+        m_blocks.emplace_back(Point(xmin, ymin), Point(xmax, ymax));
+    }
+}
+
+zorder::PointSet::Window zorder::PointSet::window(const Rect & rect) const
+{
+    Window result{rect, Rect(Point(rect.xmin() - eps, rect.ymin() - eps), Point(rect.xmax() + eps, rect.ymax() + eps))};
+    // also catches NaN
+    result.empty = m_points.empty() || !(result.area.xmin() <= result.area.xmax()) ||
+            !(result.area.ymin() <= result.area.ymax()) || !m_bounds.intersects(result.area);
+    if (!result.empty) {
+        result.zmin = detail::morton_code(Point(result.area.xmin(), result.area.ymin()), m_bounds);
+        result.zmax = detail::morton_code(Point(result.area.xmax(), result.area.ymax()), m_bounds);
+    }
+    return result;
+}
+
+std::size_t zorder::PointSet::find_block(const Window & window, std::size_t block) const
+{
+    if (window.empty) {
+        return block_count();
+    }
+    while (block < block_count()) {
+        const std::size_t last = block_end(block) - 1;
+        if (m_codes[block * block_size] > window.zmax) {
+            break;
+        }
+        std::uint64_t next = window.zmin;
+        if (m_codes[last] >= window.zmin) {
+            if (m_blocks[block].intersects(window.area)) {
+                return block;
+            }
+            if (m_codes[last] == std::numeric_limits<std::uint64_t>::max() ||
+                !next_in_box(m_codes[last] + 1, window.zmin, window.zmax, next)) {
+                break;
+            }
+        }
+        const auto it = std::lower_bound(m_codes.begin() + static_cast<std::ptrdiff_t>(last + 1), m_codes.end(), next);
+        if (it == m_codes.end()) {
+            break;
+        }
+        block = static_cast<std::size_t>(it - m_codes.begin()) / block_size;
+    }
+    return block_count();
+}
+
+void zorder::PointSet::put(const Point & point)
+{
+    if (contains(point)) {
+        return;
+    }
+    const bool inside = point.x() >= m_bounds.xmin() && point.x() <= m_bounds.xmax() &&
+            point.y() >= m_bounds.ymin() && point.y() <= m_bounds.ymax();
+    if (m_points.empty() || !inside) {
+        m_points.push_back(point);
+        build();
+        return;
+    }
+    const std::uint64_t code = detail::morton_code(point, m_bounds);
+    const auto index = std::upper_bound(m_codes.begin(), m_codes.end(), code) - m_codes.begin();
+    m_codes.insert(m_codes.begin() + index, code);
+    m_points.insert(m_points.begin() + index, point);
+    update_blocks(static_cast<std::size_t>(index) / block_size);
+}
+
+void zorder::PointSet::put_range(const std::vector<Point> & points)
+{
+    std::vector<Point> batch(points);
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+    batch.erase(std::remove_if(batch.begin(), batch.end(), [this](const Point & point) { return contains(point); }), batch.end());
+    if (batch.empty()) {
+        return;
+    }
+    m_points.insert(m_points.end(), batch.begin(), batch.end());
+    build();
+}
+
+void zorder::PointSet::erase_at(const std::size_t index)
+{
+    m_codes.erase(m_codes.begin() + static_cast<std::ptrdiff_t>(index));
+    m_points.erase(m_points.begin() + static_cast<std::ptrdiff_t>(index));
+    update_blocks(index / block_size);
+}
+
+std::size_t zorder::PointSet::erase(const Point & point)
+{
+    const std::size_t index = find(point);
+    if (index == size()) {
+        return 0;
+    }
+    erase_at(index);
+    return 1;
+}
+
+std::size_t zorder::PointSet::erase(const Rect & rect)
+{
+    // the blocks are visited in order, so the indices are increasing
+    std::vector<std::size_t> erased;
+    range_for_each(rect, [this, &erased](const Point & point) {
+        erased.push_back(static_cast<std::size_t>(&point - m_points.data()));
+    });
+    if (erased.empty()) {
+        return 0;
+    }
+    std::size_t out = erased.front();
+    for (std::size_t i = erased.front(), next = 0; i < m_points.size(); ++i) {
+        if (next < erased.size() && erased[next] == i) {
+            ++next;
+            continue;
+        }
+        m_points[out] = m_points[i];
+        m_codes[out] = m_codes[i];
+        ++out;
+    }
+    m_points.erase(m_points.begin() + static_cast<std::ptrdiff_t>(out), m_points.end());
+    m_codes.erase(m_codes.begin() + static_cast<std::ptrdiff_t>(out), m_codes.end());
+    update_blocks(erased.front() / block_size);
+    return erased.size();
+}
+
+std::size_t zorder::PointSet::find(const Point & point) const
+{
+    if (empty()) {
+        return size();
+    }
+    const std::uint64_t code = detail::morton_code(point, m_bounds);
+    for (auto it = std::lower_bound(m_codes.begin(), m_codes.end(), code); it != m_codes.end() && *it == code; ++it) {
+        const auto index = static_cast<std::size_t>(it - m_codes.begin());
+        if (m_points[index] == point) {
+            return index;
+        }
+    }
+    return size();
+}
+
+bool zorder::PointSet::contains(const Point & point) const
+{
+    return find(point) != size();
+}
+
+std::pair<zorder::PointSet::iterator, zorder::PointSet::iterator> zorder::PointSet::range(const Rect & rect) const
+{
+    Window query = window(rect);
+    if (query.empty) {
+        return {iterator(), iterator()};
+    }
+    return {iterator(this, iterator::range_t{std::move(query), 0}), iterator()};
+}
+
+std::size_t zorder::PointSet::range_count(const Rect & rect) const
+{
+    const Window query = window(rect);
+    std::size_t count = 0;
+    for (std::size_t block = find_block(query, 0); block < block_count(); block = find_block(query, block + 1)) {
+        const std::size_t begin = block * block_size;
+        const std::size_t end = block_end(block);
+        // the blocks inside the rect are counted without scanning them
+        count += rect.contains(m_blocks[block]) ? end - begin : detail::count_in_rect(m_points.data() + begin, end - begin, rect);
+    }
+    return count;
+}
+
+zorder::PointSet::iterator zorder::PointSet::begin() const
+{
+    return iterator(m_points.data());
+}
+
+zorder::PointSet::iterator zorder::PointSet::end() const
+{
+    return iterator(m_points.data() + m_points.size());
+}
+
+std::optional<Point> zorder::PointSet::nearest(const Point & point) const
+{
+    const std::vector<const Point *> heap = k_nearest(point, 1);
+    return heap.empty() ? std::optional<Point>() : std::optional<Point>(*heap.front());
+}
+
+std::pair<zorder::PointSet::iterator, zorder::PointSet::iterator> zorder::PointSet::nearest(const Point & point, std::size_t k) const
+{
+    if (k == 0) {
+        return {iterator(), iterator()};
+    }
+    if (size() <= k) {
+        return {begin(), end()};
+    }
+    return {iterator(k_nearest(point, k)), iterator()};
+}
+
+std::pair<zorder::PointSet::iterator, zorder::PointSet::iterator> zorder::PointSet::nearest(const Point & point, std::size_t k, double max_dist) const
+{
+    if (k == 0 || !(max_dist >= 0)) {
+        return {iterator(), iterator()};
+    }
+    return {iterator(k_nearest(point, k, max_dist * max_dist)), iterator()};
+}
+
+std::pair<zorder::PointSet::iterator, zorder::PointSet::iterator> zorder::PointSet::within_radius(const Point & point, double radius) const
+{
+    std::vector<const Point *> points;
+    within_radius_for_each(point, radius, [&points](const Point & candidate) {
+        points.push_back(&candidate);
+    });
+    return {iterator(std::move(points)), iterator()};
+}
+
+std::vector<const Point *> zorder::PointSet::k_nearest(const Point & point, const std::size_t k, const double sqr_max_dist) const
+{
+    std::vector<const Point *> heap;
+    if (k == 0 || empty() || !(sqr_max_dist >= 0)) {
+        return heap;
+    }
+    heap.reserve(std::min(k, size()));
+    auto less_dist = [&point](const Point * lhs, const Point * rhs) {
+        return point.sqr_distance(*lhs) < point.sqr_distance(*rhs);
+    };
+    // the points within the max distance fill the heap, then only the ones closer than its top are taken
+    const double max_bound = std::nextafter(sqr_max_dist, std::numeric_limits<double>::infinity());
+    auto bound = [&heap, k, &point, max_bound] {
+        return (heap.size() < k) ? max_bound : point.sqr_distance(*heap.front());
+    };
+    auto scan = [this, &heap, k, &point, &less_dist, &bound](const std::size_t block) {
+        const std::size_t end = block_end(block);
+        for (std::size_t i = detail::find_closer(m_points.data(), block * block_size, end, point, bound()); i < end;
+             i = detail::find_closer(m_points.data(), i + 1, end, point, bound())) {
+            if (heap.size() == k) {
+                std::pop_heap(heap.begin(), heap.end(), less_dist);
+                heap.pop_back();
+            }
+            heap.push_back(&m_points[i]);
+            std::push_heap(heap.begin(), heap.end(), less_dist);
+        }
+    };
+
+    // the blocks next to the code of the point in the array, [first, last) are scanned
+    const auto it = std::lower_bound(m_codes.begin(), m_codes.end(), detail::morton_code(point, m_bounds));
+    std::size_t first = std::min(static_cast<std::size_t>(it - m_codes.begin()) / block_size, block_count() - 1);
+    std::size_t last = first + 1;
+    scan(first);
+    while ((last - first) * block_size < k && (first > 0 || last < block_count())) {
+        if (first > 0) {
+            scan(--first);
+        }
+        if (last < block_count()) {
+            scan(last++);
+        }
+    }
+
+    // no point outside of the square around the point with the current distance can be closer
+    const double radius = std::nextafter(std::sqrt((heap.size() < k) ? sqr_max_dist : bound()), std::numeric_limits<double>::infinity());
+    const Window query = window(Rect(Point(point.x() - radius, point.y() - radius), Point(point.x() + radius, point.y() + radius)));
+    for (std::size_t block = find_block(query, 0); block < block_count(); block = find_block(query, block + 1)) {
+        if (block >= first && block < last) {
+            block = last - 1;
+            continue;
+        }
+        if (m_blocks[block].sqr_distance(point) < bound()) {
+            scan(block);
+        }
+    }
+    return heap;
+}
@@ -0,0 +1,75 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KDTREE_HAS_MMAP 1
+#endif
+
+detail::MappedFile::MappedFile(const std::string & filename, const Access access)
+{
+#ifdef KDTREE_HAS_MMAP
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat info = {};
+        if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+            m_open = true;
+            m_size = static_cast<std::size_t>(info.st_size);
+            if (m_size == 0) {
+                ::close(fd);
+                return;
+            }
+            void * address = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                ::madvise(address, m_size, (access == Access::Sequential) ? MADV_SEQUENTIAL : MADV_RANDOM);
+                m_data = static_cast<const char *>(address);
+                m_mapped = true;
+                ::close(fd);
+                return;
+            }
+        }
+        ::close(fd);
+    }
+#else
+    static_cast<void>(access);
+#endif
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        m_open = false;
+        m_size = 0;
+        return;
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    m_open = true;
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+}
+
+detail::MappedFile::~MappedFile()
+{
+#ifdef KDTREE_HAS_MMAP
+    if (m_mapped) {
+        ::munmap(const_cast<char *>(m_data), m_size);
+    }
+#endif
+}
+
+bool detail::MappedFile::is_open() const
+{
+    return m_open;
+}
+
+const char * detail::MappedFile::data() const
+{
+    return m_data;
+}
+
+std::size_t detail::MappedFile::size() const
+{
+    return m_size;
+}
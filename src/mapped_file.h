@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace detail {
+
+// Read-only view of a whole file, memory mapped where the platform allows it
+class MappedFile
+{
+public:
+    // Tells the system how the pages are going to be read
+    enum class Access
+    {
+        Sequential,
+        Random
+    };
+
+    MappedFile(const std::string & filename, Access access = Access::Sequential);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    ~MappedFile();
+
+    bool is_open() const;
+    const char * data() const;
+    std::size_t size() const;
+
+private:
+    const char * m_data = nullptr;
+    std::size_t m_size = 0;
+    bool m_open = false;
+    bool m_mapped = false;
+
+    // Used instead of the mapping when the file could not be mapped
+    std::string m_buffer;
+};
+
+} // namespace detail
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "primitives.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace detail {
+
+// Spreads the lower 32 bits so that there is a zero bit between every two of them
+inline std::uint64_t spread_bits(std::uint64_t value)
+{
+    value &= 0xffffffff;
+    value = (value | (value << 16)) & 0x0000ffff0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f0f0f0f0f;
+    value = (value | (value << 2)) & 0x3333333333333333;
+    value = (value | (value << 1)) & 0x5555555555555555;
+    return value;
+}
+
+// Z-order code of the point, coordinates are quantised to 32 bits inside the bounds
+inline std::uint64_t morton_code(const Point & point, const Rect & bounds)
+{
+    auto quantise = [](const double value, const double min, const double max) -> std::uint64_t {
+        if (!(max > min)) {
+            return 0;
+        }
+        const double scaled = (value - min) / (max - min) * 4294967295.0;
+        // also catches NaN
+        if (!(scaled > 0)) {
+            return 0;
+        }
+        return static_cast<std::uint64_t>(std::min(scaled, 4294967295.0));
+    };
+    return spread_bits(quantise(point.x(), bounds.xmin(), bounds.xmax())) |
+            (spread_bits(quantise(point.y(), bounds.ymin(), bounds.ymax())) << 1);
+}
+
+} // namespace detail
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <future>
+#include <thread>
+#include <vector>
+
+namespace detail {
+
+// Resolves a requested number of threads, 0 means one per hardware thread
+inline std::size_t thread_count(const std::size_t requested)
+{
+    return (requested != 0) ? requested : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits [0, count) into contiguous blocks and calls body(begin, end) for each of them,
+// the first block is processed by the calling thread
+template <class F>
+void parallel_for(const std::size_t count, std::size_t threads, F && body)
+{
+    threads = std::max<std::size_t>(1, std::min(threads, count));
+    std::vector<std::future<void>> tasks;
+    tasks.reserve(threads - 1);
+    for (std::size_t i = 1; i < threads; ++i) {
+        tasks.push_back(std::async(std::launch::async, [&body, i, count, threads] {
+            body(count * i / threads, count * (i + 1) / threads);
+        }));
+    }
+    body(0, count / threads);
+    for (auto & task : tasks) {
+        task.get();
+    }
+}
+
+} // namespace detail
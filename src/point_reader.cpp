@@ -0,0 +1,176 @@
+#include "point_reader.h"
+
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
+
+namespace {
+
+constexpr double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+constexpr int max_fast_exponent = 22;
+constexpr int max_mantissa_digits = 19;
+constexpr std::uint64_t max_exact_mantissa = std::uint64_t(1) << 53;
+
+// Chunks smaller than this are never given to a separate thread
+constexpr std::size_t min_chunk_size = 1 << 20;
+
+bool is_space(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+bool is_digit(const char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+const char * skip_spaces(const char * it, const char * end)
+{
+    while (it != end && is_space(*it)) {
+        ++it;
+    }
+    return it;
+}
+
+// Parses a decimal number. When the mantissa fits into 53 bits and the decimal exponent is at most 22
+// a single multiplication or division is correctly rounded, the rest goes through std::strtod.
+bool parse_double(const char *& it, const char * end, double & result)
+{
+    it = skip_spaces(it, end);
+    const char * start = it;
+    bool negative = false;
+    if (it != end && (*it == '-' || *it == '+')) {
+        negative = *it == '-';
+        ++it;
+    }
+    std::uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    bool exact = true;
+    auto add_digit = [&](const char c) {
+        any_digit = true;
+        if (digits < max_mantissa_digits) {
+            mantissa = mantissa * 10 + static_cast<std::uint64_t>(c - '0');
+            digits += (mantissa != 0) ? 1 : 0;
+        }
+        else {
+            exact = false;
+        }
+    };
+    for (; it != end && is_digit(*it); ++it) {
+        add_digit(*it);
+    }
+    if (it != end && *it == '.') {
+        for (++it; it != end && is_digit(*it); ++it) {
+            add_digit(*it);
+            --exponent;
+        }
+    }
+    if (!any_digit) {
+        it = start;
+        return false;
+    }
+    if (it != end && (*it == 'e' || *it == 'E')) {
+        const char * exponent_start = it++;
+        bool negative_exponent = false;
+        if (it != end && (*it == '-' || *it == '+')) {
+            negative_exponent = *it == '-';
+            ++it;
+        }
+        if (it == end || !is_digit(*it)) {
+            it = exponent_start;
+        }
+        else {
+            int value = 0;
+            for (; it != end && is_digit(*it); ++it) {
+                value = std::min(value * 10 + (*it - '0'), 100000);
+            }
+            exponent += negative_exponent ? -value : value;
+        }
+    }
+    if (it != end && !is_space(*it)) {
+        it = start;
+        return false;
+    }
+    if (exact && mantissa <= max_exact_mantissa && exponent >= -max_fast_exponent && exponent <= max_fast_exponent) {
+        const double value = static_cast<double>(mantissa);
+        result = (exponent < 0) ? value / pow10[-exponent] : value * pow10[exponent];
+        result = negative ? -result : result;
+    }
+    else {
+        const std::string token(start, it);
+        result = std::strtod(token.c_str(), nullptr);
+    }
+    return true;
+}
+
+struct Chunk
+{
+    std::vector<Point> points;
+    // false when parsing stopped before the end of the chunk
+    bool complete = true;
+};
+
+Chunk parse_chunk(const char * it, const char * end)
+{
+    Chunk chunk;
+    // a rough guess for lines like "0.753 0.943"
+    chunk.points.reserve(static_cast<std::size_t>(end - it) / 12);
+    for (double x, y; parse_double(it, end, x);) {
+        if (!parse_double(it, end, y)) {
+            // std::ifstream sets a failed extraction to 0, so the last x still comes in as (x, 0)
+            chunk.points.emplace_back(x, 0);
+            chunk.complete = false;
+            return chunk;
+        }
+        chunk.points.emplace_back(x, y);
+    }
+    chunk.complete = skip_spaces(it, end) == end;
+    return chunk;
+}
+
+} // namespace
+
+std::vector<Point> detail::read_points(const std::string & filename, std::size_t threads)
+{
+    const MappedFile file(filename);
+    const char * begin = file.data();
+    const char * end = begin + file.size();
+    threads = std::max<std::size_t>(1, std::min(threads, file.size() / min_chunk_size));
+
+    std::vector<const char *> bounds{begin};
+    for (std::size_t i = 1; i < threads; ++i) {
+        const char * bound = std::max(bounds.back(), begin + file.size() / threads * i);
+        bounds.push_back(std::find(bound, end, '\n'));
+    }
+    bounds.push_back(end);
+
+    std::vector<std::future<Chunk>> tasks;
+    for (std::size_t i = 1; i + 1 < bounds.size(); ++i) {
+        tasks.push_back(std::async(std::launch::async, parse_chunk, bounds[i], bounds[i + 1]));
+    }
+    Chunk result = parse_chunk(bounds[0], bounds[1]);
+    for (auto & task : tasks) {
+        Chunk chunk = task.get();
+        if (result.complete) {
+            result.points.insert(result.points.end(), chunk.points.begin(), chunk.points.end());
+            result.complete = chunk.complete;
+        }
+    }
+
+    std::vector<Point> & points = result.points;
+    std::sort(points.begin(), points.end());
+    // the same equivalence as std::set<Point> uses, adjacent points are already ordered
+    points.erase(std::unique(points.begin(),
+                             points.end(),
+                             [](const Point & lhs, const Point & rhs) {
+                                 return !(lhs < rhs);
+                             }),
+                 points.end());
+    return points;
+}
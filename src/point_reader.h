@@ -0,0 +1,16 @@
+#pragma once
+
+#include "primitives.h"
+
+#include <string>
+#include <vector>
+
+namespace detail {
+
+// Reads points stored as "x y" lines, the result is sorted and has no duplicates.
+// Reading stops at the first token that is not a number, as it does for std::ifstream,
+// and an x left without an y is read as (x, 0) the same way.
+// With several threads the file is split into chunks at line boundaries.
+std::vector<Point> read_points(const std::string & filename, std::size_t threads = 1);
+
+} // namespace detail
@@ -0,0 +1,293 @@
+#include "primitives.h"
+
+#include <limits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KDTREE_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+static_assert(sizeof(Point) == 2 * sizeof(double), "Points are scanned as pairs of doubles");
+
+// Same tolerance as in Rect::contains()
+constexpr double eps = std::numeric_limits<double>::epsilon();
+
+// Open bounds, a point is inside when it is strictly between them by both coordinates
+struct Bounds
+{
+    double xmin;
+    double ymin;
+    double xmax;
+    double ymax;
+};
+
+Bounds widen(const Rect & rect)
+{
+    return {rect.xmin() - eps, rect.ymin() - eps, rect.xmax() + eps, rect.ymax() + eps};
+}
+
+// Coordinates of the points follow each other as x0, y0, x1, y1, ...
+using find_in_rect_t = std::size_t (*)(const double *, std::size_t, std::size_t, const Bounds &);
+using count_in_rect_t = std::size_t (*)(const double *, std::size_t, const Bounds &);
+using find_closer_t = std::size_t (*)(const double *, std::size_t, std::size_t, double, double, double);
+
+bool inside(const double * point, const Bounds & bounds)
+{
+    return point[0] > bounds.xmin && point[1] > bounds.ymin && point[0] < bounds.xmax && point[1] < bounds.ymax;
+}
+
+double sqr_distance(const double * point, const double x, const double y)
+{
+    const double dx = point[0] - x;
+    const double dy = point[1] - y;
+    return dx * dx + dy * dy;
+}
+
+std::size_t find_in_rect_scalar(const double * data, std::size_t begin, const std::size_t count, const Bounds & bounds)
+{
+    for (; begin < count; ++begin) {
+        if (inside(data + 2 * begin, bounds)) {
+            return begin;
+        }
+    }
+    return count;
+}
+
+std::size_t count_in_rect_from(const double * data, const std::size_t begin, const std::size_t count, const Bounds & bounds)
+{
+    std::size_t result = 0;
+    for (std::size_t i = begin; i < count; ++i) {
+        result += static_cast<std::size_t>(inside(data + 2 * i, bounds));
+    }
+    return result;
+}
+
+std::size_t count_in_rect_scalar(const double * data, const std::size_t count, const Bounds & bounds)
+{
+    return count_in_rect_from(data, 0, count, bounds);
+}
+
+std::size_t find_closer_scalar(const double * data,
+                               std::size_t begin,
+                               const std::size_t count,
+                               const double x,
+                               const double y,
+                               const double sqr_bound)
+{
+    for (; begin < count; ++begin) {
+        if (sqr_distance(data + 2 * begin, x, y) < sqr_bound) {
+            return begin;
+        }
+    }
+    return count;
+}
+
+#ifdef KDTREE_HAS_X86_KERNELS
+
+// Every mask has a bit per coordinate, a point passes when both of its bits are set
+unsigned both_coordinates(const unsigned mask, const unsigned points)
+{
+    return mask & (mask >> 1) & points;
+}
+
+// Four points per iteration as two vectors of two points each
+
+__attribute__((target("avx2"))) unsigned inside_mask_avx2(const double * data, const __m256d low, const __m256d high)
+{
+    const __m256d first = _mm256_loadu_pd(data);
+    const __m256d second = _mm256_loadu_pd(data + 4);
+    const __m256d first_inside = _mm256_and_pd(_mm256_cmp_pd(first, low, _CMP_GT_OQ), _mm256_cmp_pd(first, high, _CMP_LT_OQ));
+    const __m256d second_inside = _mm256_and_pd(_mm256_cmp_pd(second, low, _CMP_GT_OQ), _mm256_cmp_pd(second, high, _CMP_LT_OQ));
+    const auto mask = static_cast<unsigned>(_mm256_movemask_pd(first_inside) | (_mm256_movemask_pd(second_inside) << 4));
+    return both_coordinates(mask, 0x55);
+}
+
+__attribute__((target("avx2"))) std::size_t find_in_rect_avx2(const double * data, std::size_t begin, const std::size_t count, const Bounds & bounds)
+{
+    const __m256d low = _mm256_setr_pd(bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin);
+    const __m256d high = _mm256_setr_pd(bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax);
+    for (; begin + 4 <= count; begin += 4) {
+        const unsigned mask = inside_mask_avx2(data + 2 * begin, low, high);
+        if (mask != 0) {
+            return begin + static_cast<std::size_t>(__builtin_ctz(mask)) / 2;
+        }
+    }
+    return find_in_rect_scalar(data, begin, count, bounds);
+}
+
+__attribute__((target("avx2"))) std::size_t count_in_rect_avx2(const double * data, const std::size_t count, const Bounds & bounds)
+{
+    const __m256d low = _mm256_setr_pd(bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin);
+    const __m256d high = _mm256_setr_pd(bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax);
+    std::size_t result = 0;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        result += static_cast<std::size_t>(__builtin_popcount(inside_mask_avx2(data + 2 * i, low, high)));
+    }
+    return result + count_in_rect_from(data, i, count, bounds);
+}
+
+__attribute__((target("avx2"))) unsigned closer_mask_avx2(const double * data, const __m256d query, const __m256d bound)
+{
+    const __m256d first = _mm256_sub_pd(_mm256_loadu_pd(data), query);
+    const __m256d second = _mm256_sub_pd(_mm256_loadu_pd(data + 4), query);
+    const __m256d first_sqr = _mm256_mul_pd(first, first);
+    const __m256d second_sqr = _mm256_mul_pd(second, second);
+    // both halves of a pair get dx * dx + dy * dy
+    const __m256d first_dist = _mm256_add_pd(first_sqr, _mm256_permute_pd(first_sqr, 0x5));
+    const __m256d second_dist = _mm256_add_pd(second_sqr, _mm256_permute_pd(second_sqr, 0x5));
+    const auto mask = static_cast<unsigned>(_mm256_movemask_pd(_mm256_cmp_pd(first_dist, bound, _CMP_LT_OQ)) |
+                                            (_mm256_movemask_pd(_mm256_cmp_pd(second_dist, bound, _CMP_LT_OQ)) << 4));
+    return mask & 0x55;
+}
+
+__attribute__((target("avx2"))) std::size_t find_closer_avx2(const double * data,
+                                                             std::size_t begin,
+                                                             const std::size_t count,
+                                                             const double x,
+                                                             const double y,
+                                                             const double sqr_bound)
+{
+    const __m256d query = _mm256_setr_pd(x, y, x, y);
+    const __m256d bound = _mm256_set1_pd(sqr_bound);
+    for (; begin + 4 <= count; begin += 4) {
+        const unsigned mask = closer_mask_avx2(data + 2 * begin, query, bound);
+        if (mask != 0) {
+            return begin + static_cast<std::size_t>(__builtin_ctz(mask)) / 2;
+        }
+    }
+    return find_closer_scalar(data, begin, count, x, y, sqr_bound);
+}
+
+// Eight points per iteration as two vectors of four points each, the tail is read with a masked load
+
+// Bit per coordinate of the points left
+unsigned lanes_avx512(const std::size_t remaining)
+{
+    return (remaining >= 8) ? 0xffff : (1u << (2 * remaining)) - 1;
+}
+
+__attribute__((target("avx512f"))) unsigned inside_mask_avx512(const double * data, const unsigned lanes, const __m512d low, const __m512d high)
+{
+    const __m512d first = _mm512_maskz_loadu_pd(static_cast<__mmask8>(lanes), data);
+    const __m512d second = _mm512_maskz_loadu_pd(static_cast<__mmask8>(lanes >> 8), data + 8);
+    const unsigned first_inside = _mm512_cmp_pd_mask(first, low, _CMP_GT_OQ) & _mm512_cmp_pd_mask(first, high, _CMP_LT_OQ);
+    const unsigned second_inside = _mm512_cmp_pd_mask(second, low, _CMP_GT_OQ) & _mm512_cmp_pd_mask(second, high, _CMP_LT_OQ);
+    return both_coordinates((first_inside | (second_inside << 8)) & lanes, 0x5555);
+}
+
+__attribute__((target("avx512f"))) std::size_t find_in_rect_avx512(const double * data, std::size_t begin, const std::size_t count, const Bounds & bounds)
+{
+    const __m512d low = _mm512_setr_pd(bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin);
+    const __m512d high = _mm512_setr_pd(bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax);
+    for (; begin < count; begin += 8) {
+        const unsigned mask = inside_mask_avx512(data + 2 * begin, lanes_avx512(count - begin), low, high);
+        if (mask != 0) {
+            return begin + static_cast<std::size_t>(__builtin_ctz(mask)) / 2;
+        }
+    }
+    return count;
+}
+
+__attribute__((target("avx512f"))) std::size_t count_in_rect_avx512(const double * data, const std::size_t count, const Bounds & bounds)
+{
+    const __m512d low = _mm512_setr_pd(bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin, bounds.xmin, bounds.ymin);
+    const __m512d high = _mm512_setr_pd(bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax, bounds.xmax, bounds.ymax);
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < count; i += 8) {
+        result += static_cast<std::size_t>(__builtin_popcount(inside_mask_avx512(data + 2 * i, lanes_avx512(count - i), low, high)));
+    }
+    return result;
+}
+
+__attribute__((target("avx512f"))) unsigned closer_mask_avx512(const double * data, const unsigned lanes, const __m512d query, const __m512d bound)
+{
+    // AVX-512 implies FMA, the explicitly rounded operations keep the compiler from fusing them
+    // and rounding differently from Point::sqr_distance()
+    constexpr int rounding = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+    const __m512d first = _mm512_sub_pd(_mm512_maskz_loadu_pd(static_cast<__mmask8>(lanes), data), query);
+    const __m512d second = _mm512_sub_pd(_mm512_maskz_loadu_pd(static_cast<__mmask8>(lanes >> 8), data + 8), query);
+    const __m512d first_sqr = _mm512_maskz_mul_round_pd(0xff, first, first, rounding);
+    const __m512d second_sqr = _mm512_maskz_mul_round_pd(0xff, second, second, rounding);
+    const __m512d first_dist = _mm512_maskz_add_round_pd(0xff, first_sqr, _mm512_maskz_permute_pd(0xff, first_sqr, 0x55), rounding);
+    const __m512d second_dist = _mm512_maskz_add_round_pd(0xff, second_sqr, _mm512_maskz_permute_pd(0xff, second_sqr, 0x55), rounding);
+    const unsigned mask = _mm512_cmp_pd_mask(first_dist, bound, _CMP_LT_OQ) |
+            (static_cast<unsigned>(_mm512_cmp_pd_mask(second_dist, bound, _CMP_LT_OQ)) << 8);
+    return mask & lanes & 0x5555;
+}
+
+__attribute__((target("avx512f"))) std::size_t find_closer_avx512(const double * data,
+                                                                  std::size_t begin,
+                                                                  const std::size_t count,
+                                                                  const double x,
+                                                                  const double y,
+                                                                  const double sqr_bound)
+{
+    const __m512d query = _mm512_setr_pd(x, y, x, y, x, y, x, y);
+    const __m512d bound = _mm512_set1_pd(sqr_bound);
+    for (; begin < count; begin += 8) {
+        const unsigned mask = closer_mask_avx512(data + 2 * begin, lanes_avx512(count - begin), query, bound);
+        if (mask != 0) {
+            return begin + static_cast<std::size_t>(__builtin_ctz(mask)) / 2;
+        }
+    }
+    return count;
+}
+
+#endif
+
+struct Kernels
+{
+    find_in_rect_t find_in_rect;
+    count_in_rect_t count_in_rect;
+    find_closer_t find_closer;
+};
+
+Kernels select_kernels()
+{
+#ifdef KDTREE_HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return {find_in_rect_avx512, count_in_rect_avx512, find_closer_avx512};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return {find_in_rect_avx2, count_in_rect_avx2, find_closer_avx2};
+    }
+#endif
+    return {find_in_rect_scalar, count_in_rect_scalar, find_closer_scalar};
+}
+
+// Chosen once by the features of the CPU the program runs on
+const Kernels & kernels()
+{
+    static const Kernels result = select_kernels();
+    return result;
+}
+
+const double * coordinates(const Point * points)
+{
+    return reinterpret_cast<const double *>(points);
+}
+
+} // namespace
+
+std::size_t detail::find_in_rect(const Point * points, const std::size_t begin, const std::size_t count, const Rect & rect)
+{
+    return kernels().find_in_rect(coordinates(points), begin, count, widen(rect));
+}
+
+std::size_t detail::count_in_rect(const Point * points, const std::size_t count, const Rect & rect)
+{
+    return kernels().count_in_rect(coordinates(points), count, widen(rect));
+}
+
+std::size_t detail::find_closer(const Point * points,
+                                const std::size_t begin,
+                                const std::size_t count,
+                                const Point & query,
+                                const double sqr_bound)
+{
+    return kernels().find_closer(coordinates(points), begin, count, query.x(), query.y(), sqr_bound);
+}